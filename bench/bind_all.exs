@@ -22,12 +22,27 @@ Benchee.run(
     "bind_integer" => fn %{stmt: stmt} -> XQLite.bind_integer(stmt, 1, 100) end,
     "bind_float" => fn %{stmt: stmt} -> XQLite.bind_float(stmt, 1, 42.5) end,
     "bind_text" => fn %{stmt: stmt} -> XQLite.bind_text(stmt, 1, "hello") end,
-    "bind_blob" => fn %{stmt: stmt} -> XQLite.bind_blob(stmt, 1, <<0, 0, 0>>) end
+    "bind_blob" => fn %{stmt: stmt} -> XQLite.bind_blob(stmt, 1, <<0, 0, 0>>) end,
+    "bind_blob 64KB" => fn %{stmt: stmt, blob_64kb: blob} -> XQLite.bind_blob(stmt, 1, blob) end,
+    "bind_blob 4MB" => fn %{stmt: stmt, blob_4mb: blob} -> XQLite.bind_blob(stmt, 1, blob) end,
+    "bind_text 4MB" => fn %{stmt: stmt, blob_4mb: text} -> XQLite.bind_text(stmt, 1, text) end,
+    "bind_integer + step + reset" => fn %{stmt: stmt} ->
+      XQLite.bind_integer(stmt, 1, 100)
+      XQLite.step(stmt)
+      XQLite.reset(stmt)
+    end,
+    "query_one" => fn %{stmt: stmt} -> XQLite.query_one(stmt, [100]) end
   },
   before_scenario: fn _input ->
     db = XQLite.open(":memory:", [:readonly, :nomutex])
     stmt = XQLite.prepare(db, "select ?")
-    %{db: db, stmt: stmt}
+
+    %{
+      db: db,
+      stmt: stmt,
+      blob_64kb: :binary.copy("a", 64 * 1024),
+      blob_4mb: :binary.copy("a", 4 * 1024 * 1024)
+    }
   end,
   after_scenario: fn %{db: db, stmt: stmt} ->
     XQLite.finalize(stmt)
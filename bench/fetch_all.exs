@@ -35,21 +35,29 @@ select i, 'hello' || i, null from cte
 """
 
 Benchee.run(
-  %{"fetch_all" => fn %{stmt: stmt} -> XQLite.fetch_all(stmt) end},
+  %{
+    "fetch_all" => fn %{stmt: stmt} -> XQLite.fetch_all(stmt) end,
+    "fetch_all (sub_binaries)" => fn %{sub_stmt: stmt} -> XQLite.fetch_all(stmt) end,
+    "yielding_fetch_all" => fn %{stmt: stmt} -> XQLite.yielding_fetch_all(stmt) end
+  },
   inputs: %{
     "10 rows" => 10,
     "100 rows" => 100,
     "1000 rows" => 1000,
-    "10000 rows" => 10000
+    "10000 rows" => 10000,
+    "1000000 rows" => 1_000_000
   },
   before_scenario: fn rows ->
     db = XQLite.open(":memory:", [:readonly, :nomutex])
     stmt = XQLite.prepare(db, sql, [:persistent])
     XQLite.bind_integer(stmt, 1, rows)
-    %{db: db, stmt: stmt}
+    sub_stmt = XQLite.prepare(db, sql, [:persistent, :sub_binaries])
+    XQLite.bind_integer(sub_stmt, 1, rows)
+    %{db: db, stmt: stmt, sub_stmt: sub_stmt}
   end,
-  after_scenario: fn %{db: db, stmt: stmt} ->
+  after_scenario: fn %{db: db, stmt: stmt, sub_stmt: sub_stmt} ->
     XQLite.finalize(stmt)
+    XQLite.finalize(sub_stmt)
     XQLite.close(db)
   end
 )
@@ -102,6 +102,10 @@ Benchee.run(
     "insert_all" => fn input ->
       %{insert: insert, types: types, rows: rows} = input
       XQLite.insert_all(insert, types, rows)
+    end,
+    "insert_all (batch: 100)" => fn input ->
+      %{insert: insert, types: types, rows: rows} = input
+      XQLite.insert_all(insert, types, rows, batch: 100)
     end
   },
   inputs:
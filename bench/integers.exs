@@ -0,0 +1,26 @@
+sql = """
+with recursive cte(i) as (
+  values(0)
+  union all
+  select i + 1 from cte where i < 10000
+)
+select i * ?1, i * ?1 + 1, i * ?1 + 2, i * ?1 + 3, i * ?1 + 4, i * ?1 + 5, i * ?1 + 6, i * ?1 + 7 from cte
+"""
+
+Benchee.run(
+  %{"fetch_all" => fn %{stmt: stmt} -> XQLite.fetch_all(stmt) end},
+  inputs: %{
+    "small integers" => 1,
+    "large integers" => 1_000_000_000_000
+  },
+  before_scenario: fn multiplier ->
+    db = XQLite.open(":memory:", [:readonly, :nomutex])
+    stmt = XQLite.prepare(db, sql, [:persistent])
+    XQLite.bind_integer(stmt, 1, multiplier)
+    %{db: db, stmt: stmt}
+  end,
+  after_scenario: fn %{db: db, stmt: stmt} ->
+    XQLite.finalize(stmt)
+    XQLite.close(db)
+  end
+)
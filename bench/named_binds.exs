@@ -16,6 +16,9 @@ Benchee.run(
     end,
     "bind_null" => fn %{stmt: stmt} ->
       XQLite.bind_null(stmt, 1)
+    end,
+    "bind_map" => fn %{stmt: stmt} ->
+      XQLite.bind_map(stmt, %{value: nil})
     end
   },
   before_scenario: fn _input ->
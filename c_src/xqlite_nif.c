@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,966 +13,5185 @@ static ERL_NIF_TERM am_out_of_memory;
 static ERL_NIF_TERM am_done;
 static ERL_NIF_TERM am_row;
 static ERL_NIF_TERM am_rows;
+static ERL_NIF_TERM am_error;
+static ERL_NIF_TERM am_badarg;
+static ERL_NIF_TERM am_true;
+static ERL_NIF_TERM am_false;
+static ERL_NIF_TERM am_blob;
+static ERL_NIF_TERM am_timeout;
 
 static ErlNifResourceType *db_type = NULL;
 static ErlNifResourceType *stmt_type = NULL;
+static ErlNifResourceType *plan_type = NULL;
 static sqlite3_mem_methods default_mem_methods = {0};
 
-typedef struct db
+// SQLite allocations go through ERTS allocators instead of libc malloc.
+// Small blocks are additionally recycled through per-thread free lists,
+// so that page cache and VDBE churn on dirty schedulers rarely reaches the
+// ERTS allocators. SQLite's own accounting (SQLITE_CONFIG_MEMSTATUS) is left on
+// since memory_used/0 and status/1 are built on it, so every sqlite3_malloc and
+// sqlite3_free still takes SQLite's global memory mutex before getting here.
+// Every block is prefixed with an 8 byte header holding its usable size,
+// which keeps the payload 8-byte aligned as SQLite requires.
+#define XQLITE_MEM_HEADER sizeof(sqlite3_int64)
+#define XQLITE_MEM_MIN_CLASS 64
+#define XQLITE_MEM_CLASSES 6
+#define XQLITE_MEM_MAX_CLASS (XQLITE_MEM_MIN_CLASS << (XQLITE_MEM_CLASSES - 1))
+#define XQLITE_MEM_CACHED 64
+
+typedef struct mem_cache
+{
+    void *free[XQLITE_MEM_CLASSES];
+    int count[XQLITE_MEM_CLASSES];
+    int registered;
+    struct mem_cache *next;
+} mem_cache_t;
+
+static __thread mem_cache_t mem_cache = {0};
+
+// caches are registered on first use, so that unload can release the blocks
+// cached by threads other than the one it runs on, threads that exit before
+// that (connection workers) unregister their cache with xqlite_mem_flush
+static ErlNifMutex *mem_caches_lock = NULL;
+static mem_cache_t *mem_caches = NULL;
+
+static void
+mem_cache_register(void)
+{
+    enif_mutex_lock(mem_caches_lock);
+    mem_cache.next = mem_caches;
+    mem_caches = &mem_cache;
+    mem_cache.registered = 1;
+    enif_mutex_unlock(mem_caches_lock);
+}
+
+static void
+mem_cache_unregister(void)
+{
+    enif_mutex_lock(mem_caches_lock);
+    for (mem_cache_t **cache = &mem_caches; *cache; cache = &(*cache)->next)
+    {
+        if (*cache == &mem_cache)
+        {
+            *cache = mem_cache.next;
+            break;
+        }
+    }
+
+    mem_cache.next = NULL;
+    mem_cache.registered = 0;
+    enif_mutex_unlock(mem_caches_lock);
+}
+
+static int
+mem_class(int total)
+{
+    int class = 0;
+    int class_size = XQLITE_MEM_MIN_CLASS;
+
+    while (class_size < total)
+    {
+        class_size <<= 1;
+        class++;
+    }
+
+    return class;
+}
+
+static int
+xqlite_mem_roundup(int size)
+{
+    int total = size + XQLITE_MEM_HEADER;
+    if (total <= XQLITE_MEM_MAX_CLASS)
+        return (XQLITE_MEM_MIN_CLASS << mem_class(total)) - XQLITE_MEM_HEADER;
+
+    return (size + 7) & ~7;
+}
+
+static void *
+xqlite_mem_malloc(int size)
+{
+    int usable = xqlite_mem_roundup(size);
+    int total = usable + XQLITE_MEM_HEADER;
+    sqlite3_int64 *block = NULL;
+
+    if (total <= XQLITE_MEM_MAX_CLASS)
+    {
+        int class = mem_class(total);
+        block = mem_cache.free[class];
+        if (block)
+        {
+            mem_cache.free[class] = *(void **)block;
+            mem_cache.count[class]--;
+        }
+    }
+
+    if (!block)
+        block = enif_alloc(total);
+
+    if (!block)
+        return NULL;
+
+    block[0] = usable;
+    return block + 1;
+}
+
+static void
+xqlite_mem_free(void *ptr)
+{
+    assert(ptr);
+
+    sqlite3_int64 *block = (sqlite3_int64 *)ptr - 1;
+    int total = (int)block[0] + XQLITE_MEM_HEADER;
+
+    if (total <= XQLITE_MEM_MAX_CLASS)
+    {
+        int class = mem_class(total);
+        if (mem_cache.count[class] < XQLITE_MEM_CACHED)
+        {
+            if (!mem_cache.registered)
+                mem_cache_register();
+
+            *(void **)block = mem_cache.free[class];
+            mem_cache.free[class] = block;
+            mem_cache.count[class]++;
+            return;
+        }
+    }
+
+    enif_free(block);
+}
+
+static int
+xqlite_mem_size(void *ptr)
+{
+    if (!ptr)
+        return 0;
+
+    return (int)((sqlite3_int64 *)ptr)[-1];
+}
+
+static void *
+xqlite_mem_realloc(void *ptr, int size)
+{
+    assert(ptr);
+
+    int usable = xqlite_mem_size(ptr);
+    int new_usable = xqlite_mem_roundup(size);
+
+    if (new_usable == usable)
+        return ptr;
+
+    // both blocks are too large for the free lists, let ERTS resize in place
+    if (usable + XQLITE_MEM_HEADER > XQLITE_MEM_MAX_CLASS && new_usable + XQLITE_MEM_HEADER > XQLITE_MEM_MAX_CLASS)
+    {
+        sqlite3_int64 *block = enif_realloc((sqlite3_int64 *)ptr - 1, new_usable + XQLITE_MEM_HEADER);
+        if (!block)
+            return NULL;
+
+        block[0] = new_usable;
+        return block + 1;
+    }
+
+    void *new_ptr = xqlite_mem_malloc(size);
+    if (!new_ptr)
+        return NULL;
+
+    memcpy(new_ptr, ptr, usable < new_usable ? usable : new_usable);
+    xqlite_mem_free(ptr);
+    return new_ptr;
+}
+
+static void
+mem_cache_release(mem_cache_t *cache)
+{
+    for (int class = 0; class < XQLITE_MEM_CLASSES; class++)
+    {
+        void *block = cache->free[class];
+        while (block)
+        {
+            void *next = *(void **)block;
+            enif_free(block);
+            block = next;
+        }
+
+        cache->free[class] = NULL;
+        cache->count[class] = 0;
+    }
+}
+
+// releases the blocks cached by the calling thread, called by threads about to exit
+static void
+xqlite_mem_flush(void)
+{
+    if (mem_cache.registered)
+        mem_cache_unregister();
+
+    mem_cache_release(&mem_cache);
+}
+
+// releases the blocks cached by every thread, the caller has to make sure
+// that no SQLite calls are in flight, as is the case on unload
+static void
+xqlite_mem_flush_all(void)
+{
+    enif_mutex_lock(mem_caches_lock);
+    mem_cache_t *cache = mem_caches;
+    mem_caches = NULL;
+
+    while (cache)
+    {
+        mem_cache_t *next = cache->next;
+        mem_cache_release(cache);
+        cache->next = NULL;
+        cache->registered = 0;
+        cache = next;
+    }
+
+    enif_mutex_unlock(mem_caches_lock);
+}
+
+static int
+xqlite_mem_init(void *arg)
+{
+    return SQLITE_OK;
+}
+
+static void
+xqlite_mem_shutdown(void *arg)
+{
+    xqlite_mem_flush_all();
+}
+
+static const sqlite3_mem_methods xqlite_mem_methods = {
+    xqlite_mem_malloc,
+    xqlite_mem_free,
+    xqlite_mem_realloc,
+    xqlite_mem_size,
+    xqlite_mem_roundup,
+    xqlite_mem_init,
+    xqlite_mem_shutdown,
+    NULL,
+};
+
+// returned by helpers when given malformed terms
+#define XQLITE_BADARG -1
+// returned by helpers when they fail to allocate
+#define XQLITE_NOMEM -2
+
+// xqlite specific prepare flag, stripped before calling sqlite3_prepare_v3,
+// makes multi-row results return text and blobs as sub binaries of one binary
+#define XQLITE_PREPARE_SUB_BINARIES 0x100000
+
+// requests executed by a connection's dedicated worker thread
+enum
+{
+    WORKER_EXEC,
+    WORKER_STEP,
+    WORKER_FETCH_ALL,
+    WORKER_INSERT_ALL,
+};
+
+typedef struct command
+{
+    struct command *next;
+    int op;
+    // process independent env holding the reply ref and copies of the arguments,
+    // it is also used to build and send the reply
+    ErlNifEnv *env;
+    ErlNifPid caller;
+    ERL_NIF_TERM ref;
+    ERL_NIF_TERM args[3];
+} command_t;
+
+typedef struct worker
 {
     sqlite3 *db;
-} db_t;
+    ErlNifTid tid;
+    ErlNifMutex *lock;
+    ErlNifCond *cond;
+    command_t *head;
+    command_t *tail;
+    int shutdown;
+    // set when the db resource is gone before the worker was stopped,
+    // the worker then closes the connection itself and waits to be reaped
+    int detached;
+    struct worker *next;
+} worker_t;
+
+// workers that exited on their own, joined on next open or unload
+static ErlNifMutex *exited_workers_lock = NULL;
+static worker_t *exited_workers = NULL;
+// detached workers that haven't added themselves to exited_workers yet,
+// unload waits for them on exited_workers_cond before joining
+static ErlNifCond *exited_workers_cond = NULL;
+static unsigned int detached_workers = 0;
+
+static void *worker_loop(void *arg);
+
+// binaries larger than this are refc binaries, so pinning them into
+// the statement's env only bumps a reference count instead of copying
+#define XQLITE_PIN_MIN_SIZE 64
+
+// a named parameter of a statement, looked up by bind_map
+typedef struct param_name
+{
+    // the name without its prefix as an atom, or 0 if no such atom existed when prepared
+    ERL_NIF_TERM atom;
+    int idx;
+    unsigned int size;
+    // includes the prefix, points into the same allocation as the table
+    const char *name;
+} param_name_t;
 
 typedef struct stmt
 {
     sqlite3_stmt *stmt;
+    int flags;
+    // keeps large bound binaries alive so they can be bound with SQLITE_STATIC,
+    // `pinned` holds the currently bound term (or 0) for each parameter
+    ErlNifEnv *pins;
+    ERL_NIF_TERM *pinned;
+    unsigned int pinned_size;
+    unsigned int pin_count;
+    // multi-row version of an insert for batched insert_all
+    sqlite3_stmt *wide;
+    unsigned int wide_batch;
+    // named parameters, copied at prepare time since a reprepare frees sqlite's names
+    param_name_t *names;
+    unsigned int name_count;
+    // milliseconds a single call is allowed to run, 0 means no limit
+    ErlNifSInt64 timeout;
+    // fingerprint of the query plan (0 if unknown) and the reprepare count it was taken at,
+    // only maintained for cached statements while plan tracking is on, see xqlite_check_plan
+    uint64_t plan_hash;
+    int plan_reprepares;
 } stmt_t;
 
+// LRU cache of prepared statements keyed by their SQL
+#define XQLITE_STMT_CACHE_CAPACITY 64
+
+typedef struct cache_entry
+{
+    // LRU list, most recently used first
+    struct cache_entry *prev;
+    struct cache_entry *next;
+    // hash bucket chain
+    struct cache_entry *chain;
+    uint64_t hash;
+    stmt_t *stmt;
+    size_t sql_size;
+    char sql[];
+} cache_entry_t;
+
+typedef struct stmt_cache
+{
+    ErlNifMutex *lock;
+    cache_entry_t **buckets;
+    unsigned int bucket_count;
+    cache_entry_t *head;
+    cache_entry_t *tail;
+    unsigned int size;
+    unsigned int capacity;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    // set by close, misses prepared concurrently aren't cached anymore
+    int closed;
+} stmt_cache_t;
+
+// per-call timings recorded into a per-connection ring buffer when telemetry is enabled
+#define XQLITE_OP_STEP 0
+#define XQLITE_OP_FETCH_ALL 1
+#define XQLITE_OP_INSERT_ALL 2
+#define XQLITE_OP_EXEC 3
+
+typedef struct telemetry_event
+{
+    // equals the write position once the event is written and that
+    // position plus the capacity once it has been read, see telemetry_push
+    _Atomic uint64_t seq;
+    int op;
+    int rc;
+    ErlNifTime start;
+    ErlNifTime duration;
+    uint64_t rows;
+    uint64_t vm_steps;
+    uint64_t bytes;
+} telemetry_event_t;
+
+// bounded multi-producer queue, statements of the same connection can be
+// stepped from several dirty schedulers while a poller drains the events.
+// Referenced by both the db resource and the connection's client data,
+// since statements can outlive the resource and keep the connection around
+typedef struct telemetry
+{
+    _Atomic int refs;
+    _Atomic int enabled;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    uint64_t capacity;
+    telemetry_event_t events[];
+} telemetry_t;
+
+#define XQLITE_TELEMETRY "xqlite_telemetry"
+
+// number of connections with telemetry enabled, while it's zero
+// instrumented calls skip the client data lookup
+static _Atomic int telemetry_enabled = 0;
+
+static telemetry_t *
+telemetry_alloc(uint64_t capacity)
+{
+    telemetry_t *telemetry = enif_alloc(sizeof(telemetry_t) + sizeof(telemetry_event_t) * capacity);
+    if (!telemetry)
+        return NULL;
+
+    atomic_init(&telemetry->refs, 1);
+    atomic_init(&telemetry->enabled, 0);
+    atomic_init(&telemetry->head, 0);
+    atomic_init(&telemetry->tail, 0);
+    atomic_init(&telemetry->dropped, 0);
+    telemetry->capacity = capacity;
+
+    for (uint64_t i = 0; i < capacity; i++)
+        atomic_init(&telemetry->events[i].seq, i);
+
+    return telemetry;
+}
+
 static void
-db_type_destructor(ErlNifEnv *env, void *arg)
+telemetry_enable(telemetry_t *telemetry, int enabled)
 {
-    assert(env);
-    assert(arg);
+    if (atomic_exchange(&telemetry->enabled, enabled) != enabled)
+        atomic_fetch_add(&telemetry_enabled, enabled ? 1 : -1);
+}
 
-    db_t *db = (db_t *)arg;
+static void
+telemetry_release(void *arg)
+{
+    telemetry_t *telemetry = (telemetry_t *)arg;
 
-    if (db->db)
+    if (atomic_fetch_sub(&telemetry->refs, 1) == 1)
     {
-        sqlite3_close_v2(db->db);
-        db->db = NULL;
+        telemetry_enable(telemetry, 0);
+        enif_free(telemetry);
     }
 }
 
+// adds an event unless the buffer is full, in which case it's counted as dropped
 static void
-stmt_type_destructor(ErlNifEnv *env, void *arg)
+telemetry_push(telemetry_t *telemetry, const telemetry_event_t *event)
+{
+    uint64_t pos = atomic_load_explicit(&telemetry->head, memory_order_relaxed);
+    telemetry_event_t *slot;
+
+    for (;;)
+    {
+        slot = &telemetry->events[pos % telemetry->capacity];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&telemetry->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            atomic_fetch_add_explicit(&telemetry->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&telemetry->head, memory_order_relaxed);
+        }
+    }
+
+    slot->op = event->op;
+    slot->rc = event->rc;
+    slot->start = event->start;
+    slot->duration = event->duration;
+    slot->rows = event->rows;
+    slot->vm_steps = event->vm_steps;
+    slot->bytes = event->bytes;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+// takes the oldest event, returns 0 if there is none
+static int
+telemetry_pop(telemetry_t *telemetry, telemetry_event_t *event)
+{
+    uint64_t pos = atomic_load_explicit(&telemetry->tail, memory_order_relaxed);
+    telemetry_event_t *slot;
+
+    for (;;)
+    {
+        slot = &telemetry->events[pos % telemetry->capacity];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - (pos + 1));
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&telemetry->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return 0;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&telemetry->tail, memory_order_relaxed);
+        }
+    }
+
+    event->op = slot->op;
+    event->rc = slot->rc;
+    event->start = slot->start;
+    event->duration = slot->duration;
+    event->rows = slot->rows;
+    event->vm_steps = slot->vm_steps;
+    event->bytes = slot->bytes;
+    atomic_store_explicit(&slot->seq, pos + telemetry->capacity, memory_order_release);
+    return 1;
+}
+
+// a single instrumented call, `telemetry` is NULL unless it's being recorded
+typedef struct span
+{
+    telemetry_t *telemetry;
+    ErlNifTime start;
+    uint64_t vm_steps;
+} span_t;
+
+static uint64_t
+span_vm_steps(stmt_t *stmt)
+{
+    if (!stmt)
+        return 0;
+
+    uint64_t vm_steps = sqlite3_stmt_status(stmt->stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+    if (stmt->wide)
+        vm_steps += sqlite3_stmt_status(stmt->wide, SQLITE_STMTSTATUS_VM_STEP, 0);
+
+    return vm_steps;
+}
+
+// starts recording a call on the connection, `stmt` is NULL for calls without one
+static void
+span_begin(span_t *span, sqlite3 *db, stmt_t *stmt)
+{
+    span->telemetry = NULL;
+
+    if (!atomic_load_explicit(&telemetry_enabled, memory_order_relaxed))
+        return;
+
+    // finalized statements have no connection, the call fails on its own
+    if (!db || (stmt && !stmt->stmt))
+        return;
+
+    telemetry_t *telemetry = sqlite3_get_clientdata(db, XQLITE_TELEMETRY);
+    if (!telemetry || !atomic_load_explicit(&telemetry->enabled, memory_order_relaxed))
+        return;
+
+    span->telemetry = telemetry;
+    span->vm_steps = span_vm_steps(stmt);
+    span->start = enif_monotonic_time(ERL_NIF_NSEC);
+}
+
+static void
+span_end(span_t *span, int op, int rc, stmt_t *stmt, uint64_t rows, uint64_t bytes)
+{
+    if (!span->telemetry)
+        return;
+
+    telemetry_event_t event;
+    event.op = op;
+    event.rc = rc;
+    event.start = span->start;
+    event.duration = enif_monotonic_time(ERL_NIF_NSEC) - span->start;
+    event.rows = rows;
+    event.vm_steps = span_vm_steps(stmt) - span->vm_steps;
+    event.bytes = bytes;
+    telemetry_push(span->telemetry, &event);
+}
+
+typedef struct db
+{
+    sqlite3 *db;
+    worker_t *worker;
+    stmt_cache_t cache;
+    // set once telemetry is first enabled, see xqlite_set_telemetry
+    _Atomic(telemetry_t *) telemetry;
+    // plan changes of cached statements are sent to `plan_pid`, protected by the cache lock
+    _Atomic int plan_tracking;
+    ErlNifPid plan_pid;
+} db_t;
+
+static uint64_t
+hash_sql(const unsigned char *sql, size_t size)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= sql[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static cache_entry_t *
+cache_lookup(stmt_cache_t *cache, uint64_t hash, const unsigned char *sql, size_t size)
+{
+    if (!cache->buckets)
+        return NULL;
+
+    cache_entry_t *entry = cache->buckets[hash & (cache->bucket_count - 1)];
+    while (entry)
+    {
+        if (entry->hash == hash && entry->sql_size == size && memcmp(entry->sql, sql, size) == 0)
+            return entry;
+
+        entry = entry->chain;
+    }
+
+    return NULL;
+}
+
+static void
+cache_unlink(stmt_cache_t *cache, cache_entry_t *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void
+cache_push_front(stmt_cache_t *cache, cache_entry_t *entry)
+{
+    entry->next = cache->head;
+    if (cache->head)
+        cache->head->prev = entry;
+    cache->head = entry;
+
+    if (!cache->tail)
+        cache->tail = entry;
+}
+
+// removes the entry and drops the cache's reference to its statement
+static void
+cache_remove(stmt_cache_t *cache, cache_entry_t *entry)
+{
+    cache_entry_t **link = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+    while (*link != entry)
+        link = &(*link)->chain;
+    *link = entry->chain;
+
+    cache_unlink(cache, entry);
+    cache->size--;
+
+    enif_release_resource(entry->stmt);
+    enif_free(entry);
+}
+
+static void
+cache_evict(stmt_cache_t *cache)
+{
+    while (cache->size > cache->capacity)
+    {
+        cache_remove(cache, cache->tail);
+        cache->evictions++;
+    }
+}
+
+static void
+cache_clear(stmt_cache_t *cache)
+{
+    while (cache->head)
+        cache_remove(cache, cache->head);
+}
+
+// sizes the hash table for `capacity` entries, rehashing existing ones
+static int
+cache_resize(stmt_cache_t *cache, unsigned int capacity)
+{
+    unsigned int bucket_count = 16;
+    while (bucket_count < capacity * 2)
+        bucket_count <<= 1;
+
+    if (bucket_count == cache->bucket_count)
+        return 1;
+
+    cache_entry_t **buckets = enif_alloc(sizeof(cache_entry_t *) * bucket_count);
+    if (!buckets)
+        return 0;
+
+    memset(buckets, 0, sizeof(cache_entry_t *) * bucket_count);
+
+    for (cache_entry_t *entry = cache->head; entry; entry = entry->next)
+    {
+        unsigned int idx = entry->hash & (bucket_count - 1);
+        entry->chain = buckets[idx];
+        buckets[idx] = entry;
+    }
+
+    if (cache->buckets)
+        enif_free(cache->buckets);
+
+    cache->buckets = buckets;
+    cache->bucket_count = bucket_count;
+    return 1;
+}
+
+static void
+db_type_destructor(ErlNifEnv *env, void *arg)
 {
     assert(env);
     assert(arg);
 
-    stmt_t *stmt = (stmt_t *)arg;
+    db_t *db = (db_t *)arg;
+
+    telemetry_t *telemetry = atomic_load(&db->telemetry);
+    if (telemetry)
+        telemetry_release(telemetry);
+
+    if (db->cache.lock)
+    {
+        cache_clear(&db->cache);
+        if (db->cache.buckets)
+            enif_free(db->cache.buckets);
+        enif_mutex_destroy(db->cache.lock);
+    }
+
+    if (db->worker)
+    {
+        worker_t *worker = db->worker;
+        db->worker = NULL;
+
+        enif_mutex_lock(worker->lock);
+        if (!worker->shutdown)
+        {
+            // don't block the scheduler waiting for queued commands,
+            // the worker drains its queue and closes the connection
+            enif_mutex_lock(exited_workers_lock);
+            detached_workers++;
+            enif_mutex_unlock(exited_workers_lock);
+
+            worker->shutdown = 1;
+            worker->detached = 1;
+            enif_cond_signal(worker->cond);
+            enif_mutex_unlock(worker->lock);
+            db->db = NULL;
+            return;
+        }
+        enif_mutex_unlock(worker->lock);
+
+        // already stopped and joined in close
+        enif_cond_destroy(worker->cond);
+        enif_mutex_destroy(worker->lock);
+        enif_free(worker);
+    }
+
+    if (db->db)
+    {
+        sqlite3_close_v2(db->db);
+        db->db = NULL;
+    }
+}
+
+static void
+stmt_type_destructor(ErlNifEnv *env, void *arg)
+{
+    assert(env);
+    assert(arg);
+
+    stmt_t *stmt = (stmt_t *)arg;
+
+    if (stmt->stmt)
+    {
+        sqlite3_finalize(stmt->stmt);
+        stmt->stmt = NULL;
+    }
+
+    if (stmt->pins)
+        enif_free_env(stmt->pins);
+
+    if (stmt->pinned)
+        enif_free(stmt->pinned);
+
+    if (stmt->wide)
+        sqlite3_finalize(stmt->wide);
+
+    if (stmt->names)
+        enif_free(stmt->names);
+}
+
+// destroys what on_load created before failing, on_unload isn't called then
+static int
+load_failed(void)
+{
+    if (exited_workers_cond)
+        enif_cond_destroy(exited_workers_cond);
+
+    if (exited_workers_lock)
+        enif_mutex_destroy(exited_workers_lock);
+
+    if (mem_caches_lock)
+        enif_mutex_destroy(mem_caches_lock);
+
+    exited_workers_cond = NULL;
+    exited_workers_lock = NULL;
+    mem_caches_lock = NULL;
+    return -1;
+}
+
+static int
+on_load(ErlNifEnv *env, void **priv, ERL_NIF_TERM info)
+{
+    assert(env);
+
+    am_ok = enif_make_atom(env, "ok");
+    am_xqlite = enif_make_atom(env, "xqlite");
+    am_nil = enif_make_atom(env, "nil");
+    // TODO rename to alloc_error
+    am_out_of_memory = enif_make_atom(env, "out_of_memory");
+    am_done = enif_make_atom(env, "done");
+    am_row = enif_make_atom(env, "row");
+    am_rows = enif_make_atom(env, "rows");
+    am_error = enif_make_atom(env, "error");
+    am_badarg = enif_make_atom(env, "badarg");
+    am_true = enif_make_atom(env, "true");
+    am_false = enif_make_atom(env, "false");
+    am_blob = enif_make_atom(env, "blob");
+    am_timeout = enif_make_atom(env, "timeout");
+
+    mem_caches_lock = enif_mutex_create("xqlite_mem_caches");
+    if (!mem_caches_lock)
+        return -1;
+
+    exited_workers_lock = enif_mutex_create("xqlite_exited_workers");
+    if (!exited_workers_lock)
+        return load_failed();
+
+    exited_workers_cond = enif_cond_create("xqlite_exited_workers");
+    if (!exited_workers_cond)
+        return load_failed();
+
+    db_type = enif_open_resource_type(env, "xqlite", "db_type", db_type_destructor, ERL_NIF_RT_CREATE, NULL);
+    if (!db_type)
+        return load_failed();
+
+    stmt_type = enif_open_resource_type(env, "xqlite", "stmt_type", stmt_type_destructor, ERL_NIF_RT_CREATE, NULL);
+    if (!stmt_type)
+        return load_failed();
+
+    plan_type = enif_open_resource_type(env, "xqlite", "plan_type", NULL, ERL_NIF_RT_CREATE, NULL);
+    if (!plan_type)
+        return load_failed();
+
+    // only once nothing can fail anymore
+    sqlite3_config(SQLITE_CONFIG_GETMALLOC, &default_mem_methods);
+    sqlite3_config(SQLITE_CONFIG_MALLOC, &xqlite_mem_methods);
+
+    return 0;
+}
+
+static void
+reap_workers(void)
+{
+    enif_mutex_lock(exited_workers_lock);
+    worker_t *worker = exited_workers;
+    exited_workers = NULL;
+    enif_mutex_unlock(exited_workers_lock);
+
+    while (worker)
+    {
+        worker_t *next = worker->next;
+        enif_thread_join(worker->tid, NULL);
+        enif_free(worker);
+        worker = next;
+    }
+}
+
+static void
+on_unload(ErlNifEnv *caller_env, void *priv_data)
+{
+    assert(caller_env);
+    // detached workers might still be closing their connections,
+    // they have to be done with this library before it's unloaded
+    enif_mutex_lock(exited_workers_lock);
+    while (detached_workers > 0)
+        enif_cond_wait(exited_workers_cond, exited_workers_lock);
+    enif_mutex_unlock(exited_workers_lock);
+
+    reap_workers();
+    enif_cond_destroy(exited_workers_cond);
+    enif_mutex_destroy(exited_workers_lock);
+    sqlite3_config(SQLITE_CONFIG_MALLOC, &default_mem_methods);
+    xqlite_mem_flush_all();
+    enif_mutex_destroy(mem_caches_lock);
+}
+
+static stmt_t *
+alloc_stmt(void)
+{
+    stmt_t *stmt = enif_alloc_resource(stmt_type, sizeof(stmt_t));
+    if (stmt)
+        memset(stmt, 0, sizeof(stmt_t));
+
+    return stmt;
+}
+
+// builds the statement's table of named parameters, returns 0 on allocation failure
+static int
+build_param_names(ErlNifEnv *env, stmt_t *stmt)
+{
+    int count = sqlite3_bind_parameter_count(stmt->stmt);
+    unsigned int named = 0;
+    size_t chars = 0;
+
+    for (int i = 1; i <= count; i++)
+    {
+        const char *name = sqlite3_bind_parameter_name(stmt->stmt, i);
+        // ?NNN parameters can only be bound by position
+        if (name && name[0] != '?')
+        {
+            named++;
+            chars += strlen(name);
+        }
+    }
+
+    if (!named)
+        return 1;
+
+    param_name_t *names = enif_alloc(sizeof(param_name_t) * named + chars);
+    if (!names)
+        return 0;
+
+    char *data = (char *)(names + named);
+    unsigned int n = 0;
+
+    for (int i = 1; i <= count; i++)
+    {
+        const char *name = sqlite3_bind_parameter_name(stmt->stmt, i);
+        if (!name || name[0] == '?')
+            continue;
+
+        size_t size = strlen(name);
+        memcpy(data, name, size);
+
+        names[n].idx = i;
+        names[n].size = size;
+        names[n].name = data;
+        if (!enif_make_existing_atom_len(env, data + 1, size - 1, &names[n].atom, ERL_NIF_LATIN1))
+            names[n].atom = 0;
+
+        data += size;
+        n++;
+    }
+
+    stmt->names = names;
+    stmt->name_count = named;
+    return 1;
+}
+
+// the pins are only touched under the connection mutex, so that concurrent binds
+// on a shared statement change its bindings and its pins together. Finalized
+// statements get NULL, which SQLite's mutex functions ignore
+static sqlite3_mutex *
+stmt_mutex(stmt_t *stmt)
+{
+    return stmt->stmt ? sqlite3_db_mutex(sqlite3_db_handle(stmt->stmt)) : NULL;
+}
+
+// drops pinned binaries, the statement's bindings must be cleared already
+static void
+clear_pins(stmt_t *stmt)
+{
+    if (stmt->pins)
+        enif_clear_env(stmt->pins);
+
+    if (stmt->pinned)
+        memset(stmt->pinned, 0, sizeof(ERL_NIF_TERM) * stmt->pinned_size);
+
+    stmt->pin_count = 0;
+}
+
+static void
+unpin(stmt_t *stmt, unsigned int idx)
+{
+    if (stmt->pinned && idx >= 1 && idx <= stmt->pinned_size)
+        stmt->pinned[idx - 1] = 0;
+}
+
+// clears the bindings and drops the pins they might point into
+static int
+clear_bindings(stmt_t *stmt)
+{
+    sqlite3_mutex *mutex = stmt_mutex(stmt);
+    sqlite3_mutex_enter(mutex);
+
+    int rc = sqlite3_clear_bindings(stmt->stmt);
+    clear_pins(stmt);
+
+    sqlite3_mutex_leave(mutex);
+    return rc;
+}
+
+// binds a text or blob parameter without copying it when it's large enough,
+// the binary is kept alive in the statement's env until rebound or cleared.
+// Must be called with stmt_mutex held
+static int
+bind_pinned(stmt_t *stmt, unsigned int idx, ERL_NIF_TERM term, ErlNifBinary *bin, int type)
+{
+    if (bin->size <= XQLITE_PIN_MIN_SIZE)
+    {
+        unpin(stmt, idx);
+
+        if (type == SQLITE_TEXT)
+            return sqlite3_bind_text(stmt->stmt, idx, (char *)bin->data, bin->size, SQLITE_TRANSIENT);
+
+        return sqlite3_bind_blob(stmt->stmt, idx, bin->data, bin->size, SQLITE_TRANSIENT);
+    }
+
+    if (!stmt->pinned)
+    {
+        unsigned int size = sqlite3_bind_parameter_count(stmt->stmt);
+
+        stmt->pinned = enif_alloc(sizeof(ERL_NIF_TERM) * (size ? size : 1));
+        if (!stmt->pinned)
+            return SQLITE_NOMEM;
+
+        memset(stmt->pinned, 0, sizeof(ERL_NIF_TERM) * size);
+        stmt->pinned_size = size;
+    }
+
+    if (idx < 1 || idx > stmt->pinned_size)
+        return SQLITE_RANGE;
+
+    if (!stmt->pins)
+    {
+        stmt->pins = enif_alloc_env();
+        if (!stmt->pins)
+            return SQLITE_NOMEM;
+    }
+
+    // rebinding keeps adding copies to the env, so once it holds many more
+    // terms than there are parameters, move the live ones into a fresh env.
+    // copies of refc binaries share their data, so existing bindings stay valid
+    if (stmt->pin_count >= stmt->pinned_size * 2 + 16)
+    {
+        ErlNifEnv *pins = enif_alloc_env();
+        if (!pins)
+            return SQLITE_NOMEM;
+
+        stmt->pin_count = 0;
+        for (unsigned int i = 0; i < stmt->pinned_size; i++)
+        {
+            if (stmt->pinned[i])
+            {
+                stmt->pinned[i] = enif_make_copy(pins, stmt->pinned[i]);
+                stmt->pin_count++;
+            }
+        }
+
+        enif_free_env(stmt->pins);
+        stmt->pins = pins;
+    }
+
+    ERL_NIF_TERM pinned = enif_make_copy(stmt->pins, term);
+    ErlNifBinary pinned_bin;
+    if (!enif_inspect_binary(stmt->pins, pinned, &pinned_bin))
+        return SQLITE_MISUSE;
+
+    stmt->pinned[idx - 1] = pinned;
+    stmt->pin_count++;
+
+    if (type == SQLITE_TEXT)
+        return sqlite3_bind_text(stmt->stmt, idx, (char *)pinned_bin.data, pinned_bin.size, SQLITE_STATIC);
+
+    return sqlite3_bind_blob(stmt->stmt, idx, pinned_bin.data, pinned_bin.size, SQLITE_STATIC);
+}
+
+static ERL_NIF_TERM
+make_binary(ErlNifEnv *env, const unsigned char *bytes, size_t size)
+{
+    ERL_NIF_TERM bin;
+    uint8_t *data = enif_make_new_binary(env, size, &bin);
+
+    // empty text and blobs might come with a NULL pointer
+    if (size)
+        memcpy(data, bytes, size);
+
+    return bin;
+}
+
+static ERL_NIF_TERM
+make_sqlite3_error(ErlNifEnv *env, int rc, sqlite3 *db)
+{
+    const char *msg = sqlite3_errmsg(db);
+
+    if (!msg)
+        msg = sqlite3_errstr(rc);
+
+    ERL_NIF_TERM code = enif_make_int64(env, rc);
+    ERL_NIF_TERM reason = enif_make_string(env, msg, ERL_NIF_UTF8);
+    return enif_make_tuple3(env, am_xqlite, code, reason);
+}
+
+// TODO just return rc, and let caller handle error, export the necessary nifs
+static ERL_NIF_TERM
+raise_sqlite3_error(ErlNifEnv *env, int rc, sqlite3 *db)
+{
+    return enif_raise_exception(env, make_sqlite3_error(env, rc, db));
+}
+
+static ERL_NIF_TERM
+xqlite_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 3);
+
+    ErlNifBinary path;
+    if (!enif_inspect_binary(env, argv[0], &path))
+        return enif_make_badarg(env);
+
+    int flags;
+    if (!enif_get_int(env, argv[1], &flags))
+        return enif_make_badarg(env);
+
+    int with_worker;
+    if (!enif_get_int(env, argv[2], &with_worker))
+        return enif_make_badarg(env);
+
+    reap_workers();
+
+    db_t *db = enif_alloc_resource(db_type, sizeof(db_t));
+    if (!db)
+        return enif_raise_exception(env, am_out_of_memory);
+
+    db->worker = NULL;
+    atomic_init(&db->telemetry, NULL);
+    atomic_init(&db->plan_tracking, 0);
+    memset(&db->cache, 0, sizeof(stmt_cache_t));
+    db->cache.capacity = XQLITE_STMT_CACHE_CAPACITY;
+    db->cache.lock = enif_mutex_create("xqlite_stmt_cache");
+    if (!db->cache.lock)
+    {
+        db->db = NULL;
+        enif_release_resource(db);
+        return enif_raise_exception(env, am_out_of_memory);
+    }
+
+    int rc = sqlite3_open_v2((char *)path.data, &db->db, flags, NULL);
+    if (rc != SQLITE_OK)
+    {
+        enif_release_resource(db);
+        const char *msg = sqlite3_errstr(rc);
+        ERL_NIF_TERM code = enif_make_int64(env, rc);
+        ERL_NIF_TERM reason = enif_make_string(env, msg, ERL_NIF_UTF8);
+        ERL_NIF_TERM error = enif_make_tuple3(env, am_xqlite, code, reason);
+        return enif_raise_exception(env, error);
+    }
+
+    if (with_worker)
+    {
+        worker_t *worker = enif_alloc(sizeof(worker_t));
+        if (!worker)
+        {
+            enif_release_resource(db);
+            return enif_raise_exception(env, am_out_of_memory);
+        }
+
+        memset(worker, 0, sizeof(worker_t));
+        worker->db = db->db;
+        worker->lock = enif_mutex_create("xqlite_worker");
+        worker->cond = enif_cond_create("xqlite_worker");
+
+        if (!worker->lock || !worker->cond || enif_thread_create("xqlite_worker", &worker->tid, worker_loop, worker, NULL) != 0)
+        {
+            if (worker->cond)
+                enif_cond_destroy(worker->cond);
+            if (worker->lock)
+                enif_mutex_destroy(worker->lock);
+            enif_free(worker);
+            enif_release_resource(db);
+            return enif_raise_exception(env, am_out_of_memory);
+        }
+
+        db->worker = worker;
+    }
+
+    ERL_NIF_TERM result = enif_make_resource(env, db);
+    enif_release_resource(db);
+    return result;
+}
+
+static ERL_NIF_TERM
+xqlite_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    // DB is already closed, nothing to do here
+    if (db->db == NULL)
+        return am_ok;
+
+    if (db->worker)
+    {
+        worker_t *worker = db->worker;
+
+        enif_mutex_lock(worker->lock);
+        int running = !worker->shutdown;
+        worker->shutdown = 1;
+        enif_cond_signal(worker->cond);
+        enif_mutex_unlock(worker->lock);
+
+        // waits for the already queued commands to complete,
+        // the worker struct itself is freed in the destructor
+        if (running)
+            enif_thread_join(worker->tid, NULL);
+    }
+
+    // finalizes cached statements unless they are still referenced elsewhere
+    enif_mutex_lock(db->cache.lock);
+    cache_clear(&db->cache);
+    db->cache.closed = 1;
+    enif_mutex_unlock(db->cache.lock);
+
+    int autocommit = sqlite3_get_autocommit(db->db);
+    if (autocommit == 0)
+    {
+        int rc = sqlite3_exec(db->db, "ROLLBACK;", NULL, NULL, NULL);
+        if (rc != SQLITE_OK)
+            return raise_sqlite3_error(env, rc, db->db);
+    }
+
+    // note: _v2 may not fully close the connection, hence why we check if
+    // any transaction is open above, to make sure other connections aren't
+    // blocked. v1 is guaranteed to close or error, but will return error if any
+    // unfinalized statements, which we likely have, as we rely on the destructors
+    // to later run to clean those up
+    int rc = sqlite3_close_v2(db->db);
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, db->db);
+
+    db->db = NULL;
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_prepare(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 3);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    ErlNifBinary sql;
+    if (!enif_inspect_binary(env, argv[1], &sql))
+        return enif_make_badarg(env);
+
+    int flags;
+    if (!enif_get_int(env, argv[2], &flags))
+        return enif_make_badarg(env);
+
+    stmt_t *stmt = alloc_stmt();
+    if (!stmt)
+        return enif_raise_exception(env, am_out_of_memory);
+
+    stmt->flags = flags;
+    flags &= ~XQLITE_PREPARE_SUB_BINARIES;
+
+    int rc = sqlite3_prepare_v3(db->db, (char *)sql.data, sql.size, flags, &stmt->stmt, NULL);
+    if (rc != SQLITE_OK)
+    {
+        enif_release_resource(stmt);
+        return raise_sqlite3_error(env, rc, db->db);
+    }
+
+    if (!build_param_names(env, stmt))
+    {
+        enif_release_resource(stmt);
+        return enif_raise_exception(env, am_out_of_memory);
+    }
+
+    ERL_NIF_TERM result = enif_make_resource(env, stmt);
+    enif_release_resource(stmt);
+    return result;
+}
+
+// runs EXPLAIN QUERY PLAN on the statement's SQL, returns the {id, parent, detail}
+// rows through `plan` unless it's NULL and a fingerprint of the plan through `hash`
+static int
+explain_plan(ErlNifEnv *env, sqlite3_stmt *stmt, ERL_NIF_TERM *plan, uint64_t *hash)
+{
+    char *sql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sqlite3_sql(stmt));
+    if (!sql)
+        return SQLITE_NOMEM;
+
+    sqlite3_stmt *eqp;
+    int rc = sqlite3_prepare_v2(sqlite3_db_handle(stmt), sql, -1, &eqp, NULL);
+    sqlite3_free(sql);
+
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // ids are bytecode addresses that change with unrelated code generation
+    // details, so the fingerprint uses each row's depth in the tree instead.
+    // Rows come in depth-first order, so a stack of ancestor ids is enough
+    int *stack = NULL;
+    unsigned int depth = 0;
+    unsigned int stack_size = 0;
+    uint64_t plan_hash = 0xcbf29ce484222325ULL;
+    ERL_NIF_TERM rows = enif_make_list_from_array(env, NULL, 0);
+
+    while ((rc = sqlite3_step(eqp)) == SQLITE_ROW)
+    {
+        int id = sqlite3_column_int(eqp, 0);
+        int parent = sqlite3_column_int(eqp, 1);
+        const unsigned char *detail = sqlite3_column_text(eqp, 3);
+        int size = sqlite3_column_bytes(eqp, 3);
+
+        while (depth > 0 && stack[depth - 1] != parent)
+            depth--;
+
+        if (depth == stack_size)
+        {
+            unsigned int new_size = stack_size ? stack_size * 2 : 8;
+            int *new_stack = enif_realloc(stack, sizeof(int) * new_size);
+            if (!new_stack)
+            {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+
+            stack = new_stack;
+            stack_size = new_size;
+        }
+
+        stack[depth++] = id;
+
+        plan_hash = (plan_hash ^ depth) * 0x100000001b3ULL;
+        plan_hash = (plan_hash ^ hash_sql(detail, size)) * 0x100000001b3ULL;
+
+        if (plan)
+        {
+            ERL_NIF_TERM row = enif_make_tuple3(env, enif_make_int(env, id), enif_make_int(env, parent), make_binary(env, detail, size));
+            rows = enif_make_list_cell(env, row, rows);
+        }
+    }
+
+    if (stack)
+        enif_free(stack);
+
+    sqlite3_finalize(eqp);
+
+    if (rc != SQLITE_DONE)
+        return rc;
+
+    if (plan)
+        enif_make_reverse_list(env, rows, plan);
+
+    *hash = plan_hash;
+    return SQLITE_OK;
+}
+
+static ERL_NIF_TERM
+xqlite_query_plan(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt) || !stmt->stmt)
+        return enif_make_badarg(env);
+
+    ERL_NIF_TERM plan;
+    uint64_t hash;
+    int rc = explain_plan(env, stmt->stmt, &plan, &hash);
+
+    if (rc == SQLITE_NOMEM)
+        return enif_raise_exception(env, am_out_of_memory);
+
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+
+    return plan;
+}
+
+static ERL_NIF_TERM
+xqlite_set_plan_tracking(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    ErlNifPid pid;
+    int tracking = enif_get_local_pid(env, argv[1], &pid);
+    if (!tracking && !enif_is_identical(argv[1], am_nil))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(db->cache.lock);
+    if (tracking)
+        db->plan_pid = pid;
+    atomic_store(&db->plan_tracking, tracking);
+    enif_mutex_unlock(db->cache.lock);
+
+    return am_ok;
+}
+
+// takes the plan fingerprint of a cached statement that got reprepared and sends
+// {xqlite_plan_changed, sql, plan} to the tracking process if it differs from
+// the previous one, returns the statement. Statements cached before tracking
+// was turned on have no fingerprint, so their first reprepare only records one
+static ERL_NIF_TERM
+xqlite_check_plan(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[1], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    // finalized after the check was scheduled
+    if (!stmt->stmt)
+        return argv[1];
+
+    int reprepares = sqlite3_stmt_status(stmt->stmt, SQLITE_STMTSTATUS_REPREPARE, 0);
+
+    ERL_NIF_TERM plan;
+    uint64_t plan_hash;
+
+    // a plan that can't be explained anymore fails when stepped instead
+    if (explain_plan(env, stmt->stmt, &plan, &plan_hash) != SQLITE_OK)
+        plan_hash = 0;
+
+    enif_mutex_lock(db->cache.lock);
+    int changed = stmt->plan_hash && plan_hash && stmt->plan_hash != plan_hash && atomic_load(&db->plan_tracking);
+    stmt->plan_hash = plan_hash;
+    stmt->plan_reprepares = reprepares;
+    ErlNifPid pid = db->plan_pid;
+    enif_mutex_unlock(db->cache.lock);
+
+    if (changed)
+    {
+        const char *sql = sqlite3_sql(stmt->stmt);
+        ERL_NIF_TERM sql_term = make_binary(env, (const unsigned char *)sql, strlen(sql));
+        ERL_NIF_TERM msg = enif_make_tuple3(env, enif_make_atom(env, "xqlite_plan_changed"), sql_term, plan);
+        enif_send(env, &pid, NULL, msg);
+    }
+
+    return argv[1];
+}
+
+static ERL_NIF_TERM
+xqlite_prepare_cached_miss(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db) || !db->db)
+        return enif_make_badarg(env);
+
+    ErlNifBinary sql;
+    if (!enif_inspect_binary(env, argv[1], &sql))
+        return enif_make_badarg(env);
+
+    stmt_t *stmt = alloc_stmt();
+    if (!stmt)
+        return enif_raise_exception(env, am_out_of_memory);
+
+    int rc = sqlite3_prepare_v3(db->db, (char *)sql.data, sql.size, SQLITE_PREPARE_PERSISTENT, &stmt->stmt, NULL);
+    if (rc != SQLITE_OK)
+    {
+        enif_release_resource(stmt);
+        return raise_sqlite3_error(env, rc, db->db);
+    }
+
+    if (!build_param_names(env, stmt))
+    {
+        enif_release_resource(stmt);
+        return enif_raise_exception(env, am_out_of_memory);
+    }
+
+    // the baseline plan, not visible to other processes yet so no lock is needed
+    if (atomic_load(&db->plan_tracking))
+    {
+        stmt->plan_reprepares = sqlite3_stmt_status(stmt->stmt, SQLITE_STMTSTATUS_REPREPARE, 0);
+        if (explain_plan(env, stmt->stmt, NULL, &stmt->plan_hash) != SQLITE_OK)
+            stmt->plan_hash = 0;
+    }
+
+    stmt_cache_t *cache = &db->cache;
+    uint64_t hash = hash_sql(sql.data, sql.size);
+    cache_entry_t *entry = NULL;
+
+    enif_mutex_lock(cache->lock);
+
+    // another process might have prepared the same statement in the meantime
+    cache_entry_t *existing = cache_lookup(cache, hash, sql.data, sql.size);
+    if (existing && !existing->stmt->stmt)
+    {
+        cache_remove(cache, existing);
+        existing = NULL;
+    }
+
+    if (existing)
+    {
+        cache_unlink(cache, existing);
+        cache_push_front(cache, existing);
+        stmt_t *cached = existing->stmt;
+        enif_mutex_unlock(cache->lock);
+
+        enif_release_resource(stmt);
+        return enif_make_resource(env, cached);
+    }
+
+    if (!cache->closed && cache->capacity > 0 && cache_resize(cache, cache->capacity))
+        entry = enif_alloc(sizeof(cache_entry_t) + sql.size);
+
+    if (entry)
+    {
+        entry->prev = NULL;
+        entry->next = NULL;
+        entry->hash = hash;
+        entry->stmt = stmt;
+        entry->sql_size = sql.size;
+        memcpy(entry->sql, sql.data, sql.size);
+
+        unsigned int idx = hash & (cache->bucket_count - 1);
+        entry->chain = cache->buckets[idx];
+        cache->buckets[idx] = entry;
+        cache_push_front(cache, entry);
+        cache->size++;
+
+        // the cache's reference
+        enif_keep_resource(stmt);
+        cache_evict(cache);
+    }
+
+    enif_mutex_unlock(cache->lock);
+
+    ERL_NIF_TERM result = enif_make_resource(env, stmt);
+    enif_release_resource(stmt);
+    return result;
+}
+
+static void
+reset_cached(stmt_t *stmt)
+{
+    sqlite3_mutex *mutex = stmt_mutex(stmt);
+    sqlite3_mutex_enter(mutex);
+
+    // cached statements can be finalized by hand, sqlite3_clear_bindings doesn't take NULL
+    if (stmt->stmt)
+    {
+        sqlite3_reset(stmt->stmt);
+        sqlite3_clear_bindings(stmt->stmt);
+    }
+
+    clear_pins(stmt);
+    sqlite3_mutex_leave(mutex);
+}
+
+// resets a cache hit on a dirty scheduler when the connection is busy with another
+// call, argv is {db, stmt, check_plan}
+static ERL_NIF_TERM
+xqlite_reset_cached(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 3);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[1], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    reset_cached(stmt);
+
+    if (enif_is_identical(argv[2], am_true))
+        return xqlite_check_plan(env, 2, argv);
+
+    return argv[1];
+}
+
+static ERL_NIF_TERM
+xqlite_prepare_cached(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db) || !db->db)
+        return enif_make_badarg(env);
+
+    ErlNifBinary sql;
+    if (!enif_inspect_binary(env, argv[1], &sql))
+        return enif_make_badarg(env);
+
+    stmt_cache_t *cache = &db->cache;
+    uint64_t hash = hash_sql(sql.data, sql.size);
+
+    enif_mutex_lock(cache->lock);
+
+    // statements finalized by hand are dropped and prepared again
+    cache_entry_t *entry = cache_lookup(cache, hash, sql.data, sql.size);
+    if (entry && !entry->stmt->stmt)
+    {
+        cache_remove(cache, entry);
+        entry = NULL;
+    }
+
+    if (cache->closed)
+    {
+        enif_mutex_unlock(cache->lock);
+        return enif_make_badarg(env);
+    }
+
+    if (!entry)
+    {
+        cache->misses++;
+        enif_mutex_unlock(cache->lock);
+
+        // preparing is CPU bound, same as prepare_nif
+        return enif_schedule_nif(env, "prepare_cached", ERL_NIF_DIRTY_JOB_CPU_BOUND, xqlite_prepare_cached_miss, argc, argv);
+    }
+
+    cache->hits++;
+    cache_unlink(cache, entry);
+    cache_push_front(cache, entry);
+    stmt_t *stmt = entry->stmt;
+
+    // reprepares happen while stepping after a schema change or ANALYZE
+    int check_plan = atomic_load_explicit(&db->plan_tracking, memory_order_relaxed) && stmt->stmt &&
+                     sqlite3_stmt_status(stmt->stmt, SQLITE_STMTSTATUS_REPREPARE, 0) != stmt->plan_reprepares;
+
+    enif_mutex_unlock(cache->lock);
+
+    ERL_NIF_TERM result = enif_make_resource(env, stmt);
+
+    // resetting takes the connection mutex, which a dirty call on the same
+    // connection might hold for as long as its query runs. The statement keeps
+    // its connection open, unlike db->db which close might clear by now
+    sqlite3_mutex *mutex = sqlite3_db_mutex(sqlite3_db_handle(stmt->stmt));
+    if (sqlite3_mutex_try(mutex) != SQLITE_OK)
+    {
+        ERL_NIF_TERM args[3] = {argv[0], result, check_plan ? am_true : am_false};
+        return enif_schedule_nif(env, "prepare_cached", ERL_NIF_DIRTY_JOB_CPU_BOUND, xqlite_reset_cached, 3, args);
+    }
+
+    reset_cached(stmt);
+    sqlite3_mutex_leave(mutex);
+
+    // explaining prepares a statement, so it's CPU bound as well
+    if (check_plan)
+    {
+        ERL_NIF_TERM args[2] = {argv[0], result};
+        return enif_schedule_nif(env, "prepare_cached", ERL_NIF_DIRTY_JOB_CPU_BOUND, xqlite_check_plan, 2, args);
+    }
+
+    return result;
+}
+
+static ERL_NIF_TERM
+xqlite_stmt_cache_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    stmt_cache_t *cache = &db->cache;
+
+    enif_mutex_lock(cache->lock);
+    ERL_NIF_TERM keys[5] = {
+        enif_make_atom(env, "hits"),
+        enif_make_atom(env, "misses"),
+        enif_make_atom(env, "evictions"),
+        enif_make_atom(env, "size"),
+        enif_make_atom(env, "capacity"),
+    };
+    ERL_NIF_TERM values[5] = {
+        enif_make_uint64(env, cache->hits),
+        enif_make_uint64(env, cache->misses),
+        enif_make_uint64(env, cache->evictions),
+        enif_make_uint(env, cache->size),
+        enif_make_uint(env, cache->capacity),
+    };
+    enif_mutex_unlock(cache->lock);
+
+    ERL_NIF_TERM stats;
+    enif_make_map_from_arrays(env, keys, values, 5, &stats);
+    return stats;
+}
+
+static ERL_NIF_TERM
+xqlite_set_stmt_cache_capacity(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    unsigned int capacity;
+    if (!enif_get_uint(env, argv[1], &capacity))
+        return enif_make_badarg(env);
+
+    stmt_cache_t *cache = &db->cache;
+
+    enif_mutex_lock(cache->lock);
+    cache->capacity = capacity;
+    cache_evict(cache);
+    enif_mutex_unlock(cache->lock);
+
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_bind_text(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 3);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    unsigned int idx;
+    if (!enif_get_uint(env, argv[1], &idx))
+        return enif_make_badarg(env);
+
+    ErlNifBinary text;
+    if (!enif_inspect_binary(env, argv[2], &text))
+        return enif_make_badarg(env);
+
+    sqlite3_mutex *mutex = stmt_mutex(stmt);
+    sqlite3_mutex_enter(mutex);
+    int rc = bind_pinned(stmt, idx, argv[2], &text, SQLITE_TEXT);
+    sqlite3_mutex_leave(mutex);
+
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_bind_blob(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 3);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    unsigned int idx;
+    if (!enif_get_uint(env, argv[1], &idx))
+        return enif_make_badarg(env);
+
+    ErlNifBinary blob;
+    if (!enif_inspect_binary(env, argv[2], &blob))
+        return enif_make_badarg(env);
+
+    sqlite3_mutex *mutex = stmt_mutex(stmt);
+    sqlite3_mutex_enter(mutex);
+    int rc = bind_pinned(stmt, idx, argv[2], &blob, SQLITE_BLOB);
+    sqlite3_mutex_leave(mutex);
+
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_bind_integer(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 3);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    unsigned int idx;
+    if (!enif_get_uint(env, argv[1], &idx))
+        return enif_make_badarg(env);
+
+    int i32;
+    ErlNifSInt64 i64;
+    ERL_NIF_TERM param = argv[2];
+
+    int small = enif_get_int(env, param, &i32);
+    if (!small && !enif_get_int64(env, param, &i64))
+        return enif_make_badarg(env);
+
+    sqlite3_mutex *mutex = stmt_mutex(stmt);
+    sqlite3_mutex_enter(mutex);
+
+    int rc = small ? sqlite3_bind_int(stmt->stmt, idx, i32) : sqlite3_bind_int64(stmt->stmt, idx, i64);
+    unpin(stmt, idx);
+
+    sqlite3_mutex_leave(mutex);
+
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_bind_float(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 3);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    unsigned int idx;
+    if (!enif_get_uint(env, argv[1], &idx))
+        return enif_make_badarg(env);
+
+    double f64;
+    if (!enif_get_double(env, argv[2], &f64))
+        return enif_make_badarg(env);
+
+    sqlite3_mutex *mutex = stmt_mutex(stmt);
+    sqlite3_mutex_enter(mutex);
+
+    int rc = sqlite3_bind_double(stmt->stmt, idx, f64);
+    unpin(stmt, idx);
+
+    sqlite3_mutex_leave(mutex);
+
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_bind_null(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    unsigned int idx;
+    if (!enif_get_uint(env, argv[1], &idx))
+        return enif_make_badarg(env);
+
+    sqlite3_mutex *mutex = stmt_mutex(stmt);
+    sqlite3_mutex_enter(mutex);
+
+    int rc = sqlite3_bind_null(stmt->stmt, idx);
+    unpin(stmt, idx);
+
+    sqlite3_mutex_leave(mutex);
+
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_reset(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    // TODO don't raise twice
+    int rc = sqlite3_reset(stmt->stmt);
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+make_cell(ErlNifEnv *env, sqlite3_stmt *stmt, unsigned int idx)
+{
+    switch (sqlite3_column_type(stmt, idx))
+    {
+    case SQLITE_INTEGER:
+        return enif_make_int64(env, sqlite3_column_int64(stmt, idx));
+
+    case SQLITE_FLOAT:
+        return enif_make_double(env, sqlite3_column_double(stmt, idx));
+
+    case SQLITE_TEXT:
+        return make_binary(env, sqlite3_column_text(stmt, idx), sqlite3_column_bytes(stmt, idx));
+
+    case SQLITE_BLOB:
+        return make_binary(env, sqlite3_column_blob(stmt, idx), sqlite3_column_bytes(stmt, idx));
+
+    case SQLITE_NULL:
+        return am_nil;
+
+    // TODO
+    default:
+        return am_nil;
+    }
+}
+
+static ERL_NIF_TERM
+make_row(ErlNifEnv *env, unsigned int column_count, sqlite3_stmt *stmt)
+{
+    assert(env);
+    assert(stmt);
+
+    // TODO lol this is a bit silly, but it's a start
+    switch (column_count)
+    {
+    case 0:
+        return enif_make_list(env, 0);
+    case 1:
+        return enif_make_list(env, 1, make_cell(env, stmt, 0));
+    case 2:
+        return enif_make_list(env, 2, make_cell(env, stmt, 0),
+                              make_cell(env, stmt, 1));
+    case 3:
+        return enif_make_list(env, 3, make_cell(env, stmt, 0),
+                              make_cell(env, stmt, 1), make_cell(env, stmt, 2));
+    case 4:
+        return enif_make_list(env, 4, make_cell(env, stmt, 0),
+                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
+                              make_cell(env, stmt, 3));
+    case 5:
+        return enif_make_list(env, 5, make_cell(env, stmt, 0),
+                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
+                              make_cell(env, stmt, 3), make_cell(env, stmt, 4));
+    case 6:
+        return enif_make_list(env, 6, make_cell(env, stmt, 0),
+                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
+                              make_cell(env, stmt, 3), make_cell(env, stmt, 4),
+                              make_cell(env, stmt, 5));
+    case 7:
+        return enif_make_list(env, 7, make_cell(env, stmt, 0),
+                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
+                              make_cell(env, stmt, 3), make_cell(env, stmt, 4),
+                              make_cell(env, stmt, 5), make_cell(env, stmt, 6));
+    case 8:
+        return enif_make_list(env, 8, make_cell(env, stmt, 0),
+                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
+                              make_cell(env, stmt, 3), make_cell(env, stmt, 4),
+                              make_cell(env, stmt, 5), make_cell(env, stmt, 6),
+                              make_cell(env, stmt, 7));
+    case 9:
+        return enif_make_list(env, 9, make_cell(env, stmt, 0),
+                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
+                              make_cell(env, stmt, 3), make_cell(env, stmt, 4),
+                              make_cell(env, stmt, 5), make_cell(env, stmt, 6),
+                              make_cell(env, stmt, 7), make_cell(env, stmt, 8));
+    // TODO continue till 16
+    default:
+    {
+        ERL_NIF_TERM *columns;
+        columns = enif_alloc(sizeof(ERL_NIF_TERM) * column_count);
+        if (!columns)
+            return enif_raise_exception(env, am_out_of_memory);
+
+        for (unsigned int i = 0; i < column_count; i++)
+            columns[i] = make_cell(env, stmt, i);
+
+        ERL_NIF_TERM row = enif_make_list_from_array(env, columns, column_count);
+        enif_free(columns);
+        return row;
+    }
+    }
+}
+
+// a text or blob cell copied into the arena
+typedef struct slice
+{
+    size_t cell;
+    size_t offset;
+    size_t size;
+} slice_t;
+
+#define XQLITE_ARENA_MIN_SIZE 4096
+
+// accumulates result rows of a batch, staging row terms so that the final list
+// can be built in order without a reverse pass, in sub binary mode cells are
+// staged instead so that text and blobs can be returned as sub binaries of
+// a single arena binary
+typedef struct rows
+{
+    // rows are consed onto this list when the batch is done
+    ERL_NIF_TERM list;
+    // cons rows in reverse order, for accumulating across several batches
+    int reverse;
+    int sub_binaries;
+    unsigned int column_count;
+    size_t row_count;
+    ERL_NIF_TERM *cells;
+    size_t cell_capacity;
+    slice_t *slices;
+    size_t slice_count;
+    size_t slice_capacity;
+    ErlNifBinary arena;
+    size_t arena_used;
+    int arena_allocated;
+    // payload size of the added rows, only counted for telemetry
+    int count_bytes;
+    uint64_t bytes;
+} rows_t;
+
+static void
+rows_init(rows_t *rows, stmt_t *stmt, ERL_NIF_TERM list)
+{
+    memset(rows, 0, sizeof(rows_t));
+    rows->list = list;
+    rows->sub_binaries = (stmt->flags & XQLITE_PREPARE_SUB_BINARIES) != 0;
+    rows->column_count = sqlite3_column_count(stmt->stmt);
+}
+
+static void
+rows_free(rows_t *rows)
+{
+    if (rows->arena_allocated)
+        enif_release_binary(&rows->arena);
+
+    enif_free(rows->cells);
+    enif_free(rows->slices);
+
+    rows->arena_allocated = 0;
+    rows->cells = NULL;
+    rows->slices = NULL;
+}
+
+// makes room for `needed` elements of `size` bytes, doubling the capacity
+static int
+grow_array(void **array, size_t *capacity, size_t needed, size_t size)
+{
+    if (needed <= *capacity)
+        return 1;
+
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+
+    void *new_array = enif_realloc(*array, new_capacity * size);
+    if (!new_array)
+        return 0;
+
+    *array = new_array;
+    *capacity = new_capacity;
+    return 1;
+}
+
+static int
+arena_copy(rows_t *rows, size_t cell, const void *data, size_t size)
+{
+    if (!grow_array((void **)&rows->slices, &rows->slice_capacity, rows->slice_count + 1, sizeof(slice_t)))
+        return 0;
+
+    size_t needed = rows->arena_used + size;
+    if (!rows->arena_allocated)
+    {
+        size_t arena_size = XQLITE_ARENA_MIN_SIZE;
+        while (arena_size < needed)
+            arena_size *= 2;
+
+        if (!enif_alloc_binary(arena_size, &rows->arena))
+            return 0;
+
+        rows->arena_allocated = 1;
+    }
+    else if (needed > rows->arena.size)
+    {
+        size_t arena_size = rows->arena.size * 2;
+        while (arena_size < needed)
+            arena_size *= 2;
+
+        if (!enif_realloc_binary(&rows->arena, arena_size))
+            return 0;
+    }
+
+    if (size)
+        memcpy(rows->arena.data + rows->arena_used, data, size);
+
+    slice_t *slice = &rows->slices[rows->slice_count++];
+    slice->cell = cell;
+    slice->offset = rows->arena_used;
+    slice->size = size;
+
+    rows->arena_used = needed;
+    return 1;
+}
+
+// payload size of the current row, counting numbers and NULLs as 8 bytes like binds do
+static uint64_t
+row_bytes(sqlite3_stmt *stmt, unsigned int column_count)
+{
+    uint64_t bytes = 0;
+
+    for (unsigned int i = 0; i < column_count; i++)
+    {
+        int type = sqlite3_column_type(stmt, i);
+        bytes += type == SQLITE_TEXT || type == SQLITE_BLOB ? sqlite3_column_bytes(stmt, i) : 8;
+    }
+
+    return bytes;
+}
+
+// adds the current row of the statement, returns 0 if out of memory
+static int
+rows_add(ErlNifEnv *env, rows_t *rows, sqlite3_stmt *stmt)
+{
+    unsigned int column_count = rows->column_count;
+
+    if (rows->count_bytes)
+        rows->bytes += row_bytes(stmt, column_count);
+
+    if (!rows->sub_binaries)
+    {
+        if (!grow_array((void **)&rows->cells, &rows->cell_capacity, rows->row_count + 1, sizeof(ERL_NIF_TERM)))
+            return 0;
+
+        rows->cells[rows->row_count++] = make_row(env, column_count, stmt);
+
+        return 1;
+    }
+
+    size_t first = rows->row_count * column_count;
+    if (!grow_array((void **)&rows->cells, &rows->cell_capacity, first + column_count, sizeof(ERL_NIF_TERM)))
+        return 0;
+
+    for (unsigned int i = 0; i < column_count; i++)
+    {
+        switch (sqlite3_column_type(stmt, i))
+        {
+        case SQLITE_TEXT:
+            if (!arena_copy(rows, first + i, sqlite3_column_text(stmt, i), sqlite3_column_bytes(stmt, i)))
+                return 0;
+            break;
+
+        case SQLITE_BLOB:
+            if (!arena_copy(rows, first + i, sqlite3_column_blob(stmt, i), sqlite3_column_bytes(stmt, i)))
+                return 0;
+            break;
+
+        default:
+            rows->cells[first + i] = make_cell(env, stmt, i);
+            break;
+        }
+    }
+
+    rows->row_count++;
+    return 1;
+}
+
+// returns the accumulated rows followed by `rows->list` and frees the staging buffers
+static ERL_NIF_TERM
+rows_finish(ErlNifEnv *env, rows_t *rows)
+{
+    if (rows->sub_binaries && rows->arena_allocated)
+    {
+        // don't let the sub binaries retain the unused tail
+        if (rows->arena_used < rows->arena.size)
+            enif_realloc_binary(&rows->arena, rows->arena_used);
+
+        ERL_NIF_TERM arena = enif_make_binary(env, &rows->arena);
+        rows->arena_allocated = 0;
+
+        for (size_t i = 0; i < rows->slice_count; i++)
+        {
+            slice_t *slice = &rows->slices[i];
+            rows->cells[slice->cell] = enif_make_sub_binary(env, arena, slice->offset, slice->size);
+        }
+    }
+
+    for (size_t n = 0; n < rows->row_count; n++)
+    {
+        // consing from the last row keeps them in order
+        size_t i = rows->reverse ? n : rows->row_count - 1 - n;
+
+        ERL_NIF_TERM row;
+        if (rows->sub_binaries)
+            row = enif_make_list_from_array(env, rows->cells + i * rows->column_count, rows->column_count);
+        else
+            row = rows->cells[i];
+
+        rows->list = enif_make_list_cell(env, row, rows->list);
+    }
+
+    rows_free(rows);
+    return rows->list;
+}
+
+// how many VM instructions run between progress handler calls
+#define XQLITE_PROGRESS_OPS 1000
+
+#define XQLITE_PROGRESS_BUDGET 1
+#define XQLITE_PROGRESS_TIMEOUT 2
+
+// longer timeouts (about 146 years) are treated as none,
+// which keeps the deadline in nanoseconds from overflowing
+#define XQLITE_MAX_TIMEOUT (INT64_MAX / 1000000 / 2)
+
+// state of the progress handler installed for a single call, see progress_begin
+typedef struct progress
+{
+    sqlite3 *db;
+    sqlite3_mutex *mutex;
+    // monotonic time in nanoseconds, or 0
+    ErlNifTime deadline;
+    // VM instructions, or 0
+    int budget;
+    int ops;
+    // 0 if no handler is installed
+    int period;
+    // XQLITE_PROGRESS_BUDGET or XQLITE_PROGRESS_TIMEOUT once the call is interrupted
+    int exceeded;
+} progress_t;
+
+static int
+progress_callback(void *arg)
+{
+    progress_t *progress = (progress_t *)arg;
+    progress->ops += progress->period;
+
+    if (progress->budget && progress->ops >= progress->budget)
+    {
+        progress->exceeded = XQLITE_PROGRESS_BUDGET;
+        return 1;
+    }
+
+    if (progress->deadline && enif_monotonic_time(ERL_NIF_NSEC) >= progress->deadline)
+    {
+        progress->exceeded = XQLITE_PROGRESS_TIMEOUT;
+        return 1;
+    }
+
+    return 0;
+}
+
+// same as progress_begin but with a given deadline (or 0), for calls that span
+// several NIF invocations
+static void
+progress_begin_at(stmt_t *stmt, progress_t *progress, int budget, ErlNifTime deadline)
+{
+    memset(progress, 0, sizeof(progress_t));
+
+    // finalized statements have no connection to install the handler on
+    if (!stmt->stmt || (!deadline && !budget))
+        return;
+
+    progress->budget = budget;
+    progress->period = budget && budget < XQLITE_PROGRESS_OPS ? budget : XQLITE_PROGRESS_OPS;
+    progress->deadline = deadline;
+
+    progress->db = sqlite3_db_handle(stmt->stmt);
+    progress->mutex = sqlite3_db_mutex(progress->db);
+    sqlite3_mutex_enter(progress->mutex);
+    sqlite3_progress_handler(progress->db, progress->period, progress_callback, progress);
+}
+
+// the deadline of a call starting now, 0 if the statement has no timeout
+static ErlNifTime
+stmt_deadline(stmt_t *stmt)
+{
+    if (!stmt->timeout)
+        return 0;
+
+    return enif_monotonic_time(ERL_NIF_NSEC) + stmt->timeout * 1000000;
+}
+
+// installs a progress handler enforcing the statement's timeout and an optional
+// budget of VM instructions, does nothing if there is neither. The handler belongs
+// to the connection, so its mutex (if there is one) is held until progress_end
+static void
+progress_begin(stmt_t *stmt, progress_t *progress, int budget)
+{
+    progress_begin_at(stmt, progress, budget, stmt_deadline(stmt));
+}
+
+static void
+progress_end(progress_t *progress)
+{
+    if (!progress->period)
+        return;
+
+    sqlite3_progress_handler(progress->db, 0, NULL, NULL);
+    sqlite3_mutex_leave(progress->mutex);
+}
+
+// raises the error of a failed step, or timeout if the statement ran past its deadline
+static ERL_NIF_TERM
+raise_step_error(ErlNifEnv *env, stmt_t *stmt, progress_t *progress, int rc)
+{
+    if (rc == SQLITE_INTERRUPT && progress->exceeded == XQLITE_PROGRESS_TIMEOUT)
+    {
+        sqlite3_reset(stmt->stmt);
+        return enif_raise_exception(env, am_timeout);
+    }
+
+    return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+}
+
+// turns the result of a single sqlite3_step into {row, row}, done or an exception
+static ERL_NIF_TERM
+make_step_result(ErlNifEnv *env, stmt_t *stmt, progress_t *progress, int rc)
+{
+    switch (rc)
+    {
+    case SQLITE_ROW:
+    {
+        unsigned int column_count = sqlite3_column_count(stmt->stmt);
+        ERL_NIF_TERM row = make_row(env, column_count, stmt->stmt);
+        return enif_make_tuple2(env, am_row, row);
+    }
+
+    case SQLITE_DONE:
+        return am_done;
+
+    default:
+        return raise_step_error(env, stmt, progress, rc);
+    }
+}
+
+static ERL_NIF_TERM
+xqlite_step(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    span_t span;
+    span_begin(&span, sqlite3_db_handle(stmt->stmt), stmt);
+
+    progress_t progress;
+    progress_begin(stmt, &progress, 0);
+
+    int rc = sqlite3_step(stmt->stmt);
+    ERL_NIF_TERM result = make_step_result(env, stmt, &progress, rc);
+
+    progress_end(&progress);
+
+    if (span.telemetry)
+    {
+        uint64_t bytes = rc == SQLITE_ROW ? row_bytes(stmt->stmt, sqlite3_column_count(stmt->stmt)) : 0;
+        span_end(&span, XQLITE_OP_STEP, rc, stmt, rc == SQLITE_ROW, bytes);
+    }
+
+    return result;
+}
+
+// steps a statement on a regular scheduler, aborting and moving to a dirty
+// scheduler once it runs more than `budget` VM instructions. Only statements
+// that can be restarted transparently (read-only and not yet stepped) start
+// here, everything else goes to the dirty scheduler right away
+static ERL_NIF_TERM
+xqlite_adaptive_step(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt) || !stmt->stmt)
+        return enif_make_badarg(env);
+
+    int budget;
+    if (!enif_get_int(env, argv[1], &budget))
+        return enif_make_badarg(env);
+
+    if (budget <= 0 || !sqlite3_stmt_readonly(stmt->stmt) || sqlite3_stmt_busy(stmt->stmt))
+        return enif_schedule_nif(env, "step", ERL_NIF_DIRTY_JOB_IO_BOUND, xqlite_step, 1, argv);
+
+    // another process might be running a long query on the same connection,
+    // the budget doesn't help with waiting for it, so that's left to a dirty
+    // scheduler as well. The mutex is recursive, so the calls below don't block
+    sqlite3 *db = sqlite3_db_handle(stmt->stmt);
+    sqlite3_mutex *mutex = sqlite3_db_mutex(db);
+    if (sqlite3_mutex_try(mutex) != SQLITE_OK)
+        return enif_schedule_nif(env, "step", ERL_NIF_DIRTY_JOB_IO_BOUND, xqlite_step, 1, argv);
+
+    span_t span;
+    span_begin(&span, db, stmt);
+
+    progress_t progress;
+    progress_begin(stmt, &progress, budget);
+
+    int rc = sqlite3_step(stmt->stmt);
+
+    // the dirty step starts over with a fresh deadline
+    if (rc == SQLITE_INTERRUPT && progress.exceeded == XQLITE_PROGRESS_BUDGET)
+    {
+        sqlite3_reset(stmt->stmt);
+        progress_end(&progress);
+        sqlite3_mutex_leave(mutex);
+        return enif_schedule_nif(env, "step", ERL_NIF_DIRTY_JOB_IO_BOUND, xqlite_step, 1, argv);
+    }
+
+    ERL_NIF_TERM result = make_step_result(env, stmt, &progress, rc);
+    progress_end(&progress);
+
+    if (span.telemetry)
+    {
+        uint64_t bytes = rc == SQLITE_ROW ? row_bytes(stmt->stmt, sqlite3_column_count(stmt->stmt)) : 0;
+        span_end(&span, XQLITE_OP_STEP, rc, stmt, rc == SQLITE_ROW, bytes);
+    }
+
+    sqlite3_mutex_leave(mutex);
+    return result;
+}
+
+// steps the statement up to `steps` times, adding rows to `rows`, returns SQLITE_ROW
+// if more rows might be available, SQLITE_DONE, XQLITE_NOMEM or an error code
+static int
+step_rows(ErlNifEnv *env, sqlite3_stmt *stmt, unsigned int steps, rows_t *rows)
+{
+    for (unsigned int step = 0; step < steps; step++)
+    {
+        int rc = sqlite3_step(stmt);
+        switch (rc)
+        {
+        case SQLITE_DONE:
+            return rc;
+
+        case SQLITE_ROW:
+            if (!rows_add(env, rows, stmt))
+            {
+                sqlite3_reset(stmt);
+                return XQLITE_NOMEM;
+            }
+            break;
+
+        default:
+            // TODO don't lose rc
+            sqlite3_reset(stmt);
+            return rc;
+        }
+    }
+
+    return SQLITE_ROW;
+}
+
+static ERL_NIF_TERM
+xqlite_multi_step(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    unsigned int steps;
+    if (!enif_get_uint(env, argv[1], &steps))
+        return enif_make_badarg(env);
+
+    span_t span;
+    span_begin(&span, sqlite3_db_handle(stmt->stmt), stmt);
+
+    progress_t progress;
+    progress_begin(stmt, &progress, 0);
+
+    rows_t rows;
+    rows_init(&rows, stmt, enif_make_list_from_array(env, NULL, 0));
+    rows.count_bytes = span.telemetry != NULL;
+    int rc = step_rows(env, stmt->stmt, steps, &rows);
+    uint64_t row_count = rows.row_count;
+    ERL_NIF_TERM result;
+
+    switch (rc)
+    {
+    case SQLITE_ROW:
+        result = enif_make_tuple2(env, am_rows, rows_finish(env, &rows));
+        break;
+
+    case SQLITE_DONE:
+        result = enif_make_tuple2(env, am_done, rows_finish(env, &rows));
+        break;
+
+    case XQLITE_NOMEM:
+        rows_free(&rows);
+        result = enif_raise_exception(env, am_out_of_memory);
+        break;
+
+    default:
+        rows_free(&rows);
+        result = raise_step_error(env, stmt, &progress, rc);
+        break;
+    }
+
+    progress_end(&progress);
+    span_end(&span, XQLITE_OP_STEP, rc, stmt, row_count, rows.bytes);
+    return result;
+}
+
+static ERL_NIF_TERM
+xqlite_interrupt(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    sqlite3_interrupt(db->db);
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_set_timeout(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    ErlNifSInt64 timeout;
+    if (!enif_get_int64(env, argv[1], &timeout) || timeout < 0)
+        return enif_make_badarg(env);
+
+    stmt->timeout = timeout > XQLITE_MAX_TIMEOUT ? 0 : timeout;
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_finalize(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    if (stmt->stmt)
+    {
+        sqlite3_finalize(stmt->stmt);
+        stmt->stmt = NULL;
+    }
+
+    if (stmt->wide)
+    {
+        sqlite3_finalize(stmt->wide);
+        stmt->wide = NULL;
+    }
+
+    clear_pins(stmt);
+    return am_ok;
+}
+
+// how much an insert_all pass has inserted, the insert loops
+// stop once `max_rows` or `max_bytes` is reached, 0 means no limit
+typedef struct insert_progress
+{
+    unsigned long rows;
+    size_t bytes;
+    unsigned long max_rows;
+    size_t max_bytes;
+} insert_progress_t;
+
+static int
+insert_limit_reached(const insert_progress_t *progress)
+{
+    return (progress->max_rows && progress->rows >= progress->max_rows) ||
+           (progress->max_bytes && progress->bytes >= progress->max_bytes);
+}
+
+// binds a value to parameter `idx` and adds its size to `bytes`, NULLs and numbers
+// count as 8 bytes, returns SQLITE_OK, XQLITE_BADARG on malformed input, or an error code
+typedef int (*binder_t)(ErlNifEnv *env, sqlite3_stmt *stmt, int idx, ERL_NIF_TERM param, size_t *bytes);
+
+static int
+bind_integer_param(ErlNifEnv *env, sqlite3_stmt *stmt, int idx, ERL_NIF_TERM param, size_t *bytes)
+{
+    int i32;
+    ErlNifSInt64 i64;
+
+    *bytes += 8;
+
+    if (enif_get_int(env, param, &i32))
+        return sqlite3_bind_int(stmt, idx, i32);
+
+    if (enif_get_int64(env, param, &i64))
+        return sqlite3_bind_int64(stmt, idx, i64);
+
+    if (enif_is_identical(param, am_nil))
+        return sqlite3_bind_null(stmt, idx);
+
+    return XQLITE_BADARG;
+}
+
+static int
+bind_float_param(ErlNifEnv *env, sqlite3_stmt *stmt, int idx, ERL_NIF_TERM param, size_t *bytes)
+{
+    double f64;
+
+    *bytes += 8;
+
+    if (enif_get_double(env, param, &f64))
+        return sqlite3_bind_double(stmt, idx, f64);
+
+    if (enif_is_identical(param, am_nil))
+        return sqlite3_bind_null(stmt, idx);
+
+    return XQLITE_BADARG;
+}
+
+static int
+bind_text_param(ErlNifEnv *env, sqlite3_stmt *stmt, int idx, ERL_NIF_TERM param, size_t *bytes)
+{
+    ErlNifBinary text;
+
+    if (enif_inspect_binary(env, param, &text))
+    {
+        *bytes += text.size;
+        return sqlite3_bind_text(stmt, idx, (char *)text.data, text.size, SQLITE_STATIC);
+    }
+
+    *bytes += 8;
+
+    if (enif_is_identical(param, am_nil))
+        return sqlite3_bind_null(stmt, idx);
+
+    return XQLITE_BADARG;
+}
+
+static int
+bind_blob_param(ErlNifEnv *env, sqlite3_stmt *stmt, int idx, ERL_NIF_TERM param, size_t *bytes)
+{
+    ErlNifBinary blob;
+
+    if (enif_inspect_binary(env, param, &blob))
+    {
+        *bytes += blob.size;
+        return sqlite3_bind_blob(stmt, idx, (char *)blob.data, blob.size, SQLITE_STATIC);
+    }
+
+    *bytes += 8;
+
+    if (enif_is_identical(param, am_nil))
+        return sqlite3_bind_null(stmt, idx);
+
+    return XQLITE_BADARG;
+}
+
+// parameter types and their binders, validated against a statement's parameter count
+typedef struct plan
+{
+    int count;
+    int *types;
+    binder_t *binders;
+} plan_t;
+
+// builds a plan from a list with a type for each of the statement's parameters,
+// returns NULL on malformed input or if out of memory, release it when done
+static plan_t *
+make_plan(ErlNifEnv *env, sqlite3_stmt *stmt, ERL_NIF_TERM types)
+{
+    int count = sqlite3_bind_parameter_count(stmt);
+
+    unsigned int length;
+    if (!enif_get_list_length(env, types, &length) || length != count)
+        return NULL;
+
+    // types and binders are kept in the same allocation as the resource
+    size_t size = sizeof(plan_t) + count * (sizeof(binder_t) + sizeof(int));
+    plan_t *plan = enif_alloc_resource(plan_type, size);
+    if (!plan)
+        return NULL;
+
+    plan->count = count;
+    plan->binders = (binder_t *)(plan + 1);
+    plan->types = (int *)(plan->binders + count);
+
+    ERL_NIF_TERM head;
+    for (int i = 0; i < count; i++)
+    {
+        enif_get_list_cell(env, types, &head, &types);
+
+        int type = 0;
+        enif_get_int(env, head, &type);
+
+        switch (type)
+        {
+        case SQLITE_INTEGER:
+            plan->binders[i] = bind_integer_param;
+            break;
+        case SQLITE_FLOAT:
+            plan->binders[i] = bind_float_param;
+            break;
+        case SQLITE_TEXT:
+            plan->binders[i] = bind_text_param;
+            break;
+        case SQLITE_BLOB:
+            plan->binders[i] = bind_blob_param;
+            break;
+        default:
+            enif_release_resource(plan);
+            return NULL;
+        }
+
+        plan->types[i] = type;
+    }
+
+    return plan;
+}
+
+// returns the plan passed as `term` or builds one from a list of types,
+// returns NULL if neither matches the statement, release it when done
+static plan_t *
+get_plan(ErlNifEnv *env, sqlite3_stmt *stmt, ERL_NIF_TERM term)
+{
+    plan_t *plan;
+    if (!enif_get_resource(env, term, plan_type, (void **)&plan))
+        return make_plan(env, stmt, term);
+
+    if (plan->count != sqlite3_bind_parameter_count(stmt))
+        return NULL;
+
+    enif_keep_resource(plan);
+    return plan;
+}
+
+static ERL_NIF_TERM
+xqlite_bind_plan(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    plan_t *plan = make_plan(env, stmt->stmt, argv[1]);
+    if (!plan)
+        return enif_make_badarg(env);
+
+    ERL_NIF_TERM result = enif_make_resource(env, plan);
+    enif_release_resource(plan);
+    return result;
+}
+
+// binds a row to parameters `offset + 1` to `offset + plan->count` and adds its size to `bytes`,
+// returns SQLITE_OK, XQLITE_BADARG on malformed input, or an error code
+static int
+bind_row(ErlNifEnv *env, sqlite3_stmt *stmt, const plan_t *plan, ERL_NIF_TERM row, int offset, size_t *bytes)
+{
+    binder_t *binders = plan->binders;
+    int count = plan->count;
+
+    for (int i = 0; i < count; i++)
+    {
+        ERL_NIF_TERM param;
+
+        if (!enif_get_list_cell(env, row, &param, &row))
+            return XQLITE_BADARG;
+
+        int rc = binders[i](env, stmt, offset + i + 1, param, bytes);
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+
+    return SQLITE_OK;
+}
+
+// binds and executes the statement for each row until a limit is reached,
+// `rows` is left pointing at the rows that were not inserted,
+// returns SQLITE_DONE, XQLITE_BADARG on malformed input, or an error code
+static int
+bind_step_rows(ErlNifEnv *env, sqlite3_stmt *stmt, const plan_t *plan, ERL_NIF_TERM *rows, insert_progress_t *progress)
+{
+    ERL_NIF_TERM head, tail;
+    int rc;
+
+    while (!insert_limit_reached(progress) && enif_get_list_cell(env, *rows, &head, &tail))
+    {
+        // TODO dont lose rc
+        sqlite3_reset(stmt);
+
+        rc = bind_row(env, stmt, plan, head, 0, &progress->bytes);
+        if (rc != SQLITE_OK)
+            return rc;
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE)
+            return rc;
+
+        *rows = tail;
+        progress->rows++;
+    }
+
+    return SQLITE_DONE;
+}
+
+// binds and executes the multi-row statement for each full batch of rows that
+// fits in the row limit, `rows` is left pointing at the remaining rows,
+// returns SQLITE_DONE, XQLITE_BADARG on malformed input, or an error code
+static int
+bind_step_batches(ErlNifEnv *env, sqlite3_stmt *wide, unsigned int batch, const plan_t *plan, ERL_NIF_TERM *rows, insert_progress_t *progress)
+{
+    ERL_NIF_TERM head, tail;
+    int rc;
+
+    while (1)
+    {
+        sqlite3_reset(wide);
+
+        if (insert_limit_reached(progress) || (progress->max_rows && progress->rows + batch > progress->max_rows))
+            return SQLITE_DONE;
+
+        size_t bytes = progress->bytes;
+
+        ERL_NIF_TERM batch_rows = *rows;
+        unsigned int bound = 0;
+
+        while (bound < batch && enif_get_list_cell(env, batch_rows, &head, &tail))
+        {
+            rc = bind_row(env, wide, plan, head, bound * plan->count, &bytes);
+            if (rc != SQLITE_OK)
+                return rc;
+
+            batch_rows = tail;
+            bound++;
+        }
+
+        if (bound < batch)
+            return SQLITE_DONE;
+
+        rc = sqlite3_step(wide);
+        if (rc != SQLITE_DONE)
+            return rc;
+
+        *rows = batch_rows;
+        progress->rows += batch;
+        progress->bytes = bytes;
+    }
+}
+
+static int
+is_identifier_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || (c & 0x80);
+}
+
+static int
+is_space_char(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+// rewrites `INSERT ... VALUES (?, ?) ...` into a statement with `batch` value tuples,
+// returns NULL if the statement isn't an insert with a single tuple of `count`
+// anonymous parameters, the result is freed with enif_free
+static char *
+widen_insert_sql(const char *sql, int count, unsigned int batch)
+{
+    const char *start = sql;
+    while (is_space_char(*start))
+        start++;
+
+    if (sqlite3_strnicmp(start, "INSERT", 6) != 0 && sqlite3_strnicmp(start, "REPLACE", 7) != 0)
+        return NULL;
+
+    // the last VALUES keyword, there is at most one in an insert without subqueries
+    const char *values = NULL;
+    for (const char *p = start; *p; p++)
+    {
+        if (sqlite3_strnicmp(p, "VALUES", 6) == 0 && (p == sql || !is_identifier_char(p[-1])) && !is_identifier_char(p[6]))
+            values = p;
+    }
+
+    if (!values)
+        return NULL;
+
+    const char *tuple = values + 6;
+    while (is_space_char(*tuple))
+        tuple++;
+
+    if (*tuple != '(')
+        return NULL;
+
+    int params = 0;
+    const char *end = tuple + 1;
+    for (; *end != ')'; end++)
+    {
+        if (*end == '?')
+            params++;
+        else if (*end != ',' && !is_space_char(*end))
+            return NULL;
+    }
+
+    end++;
+    if (params != count)
+        return NULL;
+
+    size_t prefix_size = tuple - sql;
+    size_t tuple_size = end - tuple;
+    size_t suffix_size = strlen(end);
+
+    char *wide = enif_alloc(prefix_size + batch * (tuple_size + 1) + suffix_size + 1);
+    if (!wide)
+        return NULL;
+
+    char *p = wide;
+    memcpy(p, sql, prefix_size);
+    p += prefix_size;
+
+    for (unsigned int i = 0; i < batch; i++)
+    {
+        if (i)
+            *p++ = ',';
+
+        memcpy(p, tuple, tuple_size);
+        p += tuple_size;
+    }
+
+    memcpy(p, end, suffix_size + 1);
+    return wide;
+}
+
+// returns the statement's cached multi-row version for `batch` rows or NULL
+// if it can't be rewritten, `batch` might be lowered to fit the parameter limit
+static sqlite3_stmt *
+prepare_wide(stmt_t *stmt, int count, unsigned int *batch)
+{
+    sqlite3 *db = sqlite3_db_handle(stmt->stmt);
+
+    int max_batch = count ? sqlite3_limit(db, SQLITE_LIMIT_VARIABLE_NUMBER, -1) / count : 0;
+    if (*batch > max_batch)
+        *batch = max_batch;
+
+    if (*batch < 2)
+        return NULL;
+
+    if (stmt->wide && stmt->wide_batch == *batch)
+        return stmt->wide;
+
+    if (stmt->wide)
+    {
+        sqlite3_finalize(stmt->wide);
+        stmt->wide = NULL;
+    }
+
+    char *sql = widen_insert_sql(sqlite3_sql(stmt->stmt), count, *batch);
+    if (!sql)
+        return NULL;
+
+    int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt->wide, NULL);
+    enif_free(sql);
+
+    if (rc != SQLITE_OK)
+    {
+        sqlite3_finalize(stmt->wide);
+        stmt->wide = NULL;
+        return NULL;
+    }
+
+    stmt->wide_batch = *batch;
+    return stmt->wide;
+}
+
+// inserts rows in multi-row batches of `batch` rows when the statement can be
+// rewritten that way, the remaining rows are inserted one by one, stops once
+// a limit of `progress` is reached and leaves `rows` at the rows not inserted,
+// `types` is a bind plan or a list of types
+static int
+insert_rows(ErlNifEnv *env, stmt_t *stmt, ERL_NIF_TERM types, ERL_NIF_TERM *rows, unsigned int batch, insert_progress_t *progress)
+{
+    plan_t *plan = get_plan(env, stmt->stmt, types);
+    if (!plan)
+        return XQLITE_BADARG;
+
+    int rc = SQLITE_DONE;
+
+    sqlite3_stmt *wide = prepare_wide(stmt, plan->count, &batch);
+    if (wide)
+    {
+        rc = bind_step_batches(env, wide, batch, plan, rows, progress);
+        sqlite3_reset(wide);
+        sqlite3_clear_bindings(wide);
+    }
+
+    if (rc == SQLITE_DONE)
+        rc = bind_step_rows(env, stmt->stmt, plan, rows, progress);
+
+    enif_release_resource(plan);
+
+    // text and blobs are bound with SQLITE_STATIC since the rows outlive the loop,
+    // but not the NIF call, so SQLite must not keep pointers into them
+    clear_bindings(stmt);
+    return rc;
+}
+
+// inserts rows, optionally in transactions committed every `max_rows` rows
+// or `max_bytes` bytes, the NIF reschedules itself after each commit
+// with the remaining rows, returns the number of inserted rows
+static ERL_NIF_TERM
+xqlite_insert_all(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 5);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    const ERL_NIF_TERM *opts;
+    int opts_arity;
+    if (!enif_get_tuple(env, argv[3], &opts_arity, &opts) || opts_arity != 4)
+        return enif_make_badarg(env);
+
+    unsigned int batch;
+    int transaction;
+    ErlNifUInt64 max_rows, max_bytes, inserted;
+
+    if (!enif_get_uint(env, opts[0], &batch) ||
+        !enif_get_int(env, opts[1], &transaction) ||
+        !enif_get_uint64(env, opts[2], &max_rows) ||
+        !enif_get_uint64(env, opts[3], &max_bytes) ||
+        !enif_get_uint64(env, argv[4], &inserted))
+        return enif_make_badarg(env);
+
+    insert_progress_t progress = {0};
+    if (transaction)
+    {
+        progress.max_rows = max_rows;
+        progress.max_bytes = max_bytes;
+    }
+
+    sqlite3 *db = sqlite3_db_handle(stmt->stmt);
+    int rc;
+
+    span_t span;
+    span_begin(&span, db, stmt);
+
+    if (transaction)
+    {
+        rc = sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+        if (rc != SQLITE_OK)
+        {
+            span_end(&span, XQLITE_OP_INSERT_ALL, rc, stmt, 0, 0);
+            return raise_sqlite3_error(env, rc, db);
+        }
+    }
+
+    ERL_NIF_TERM rows = argv[2];
+    rc = insert_rows(env, stmt, argv[1], &rows, batch, &progress);
+
+    if (rc == SQLITE_DONE && transaction)
+    {
+        rc = sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+        if (rc == SQLITE_OK)
+            rc = SQLITE_DONE;
+    }
+
+    // each rescheduled chunk is recorded separately
+    span_end(&span, XQLITE_OP_INSERT_ALL, rc, stmt, progress.rows, progress.bytes);
+
+    if (rc != SQLITE_DONE)
+    {
+        ERL_NIF_TERM error = rc == XQLITE_BADARG ? 0 : make_sqlite3_error(env, rc, db);
+
+        // rows of previously committed chunks stay inserted
+        if (transaction && !sqlite3_get_autocommit(db))
+            sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+
+        if (!error)
+            return enif_make_badarg(env);
+
+        return enif_raise_exception(env, error);
+    }
+
+    inserted += progress.rows;
+
+    if (!enif_is_empty_list(env, rows))
+    {
+        ERL_NIF_TERM args[5] = {argv[0], argv[1], rows, argv[3], enif_make_uint64(env, inserted)};
+        return enif_schedule_nif(env, "dirty_io_insert_all_nif", ERL_NIF_DIRTY_JOB_IO_BOUND, xqlite_insert_all, 5, args);
+    }
+
+    return enif_make_uint64(env, inserted);
+}
+
+// a parameter's values for insert_columns, either a list
+// or a packed binary of native 64 bit integers or doubles
+typedef struct input_column
+{
+    binder_t bind;
+    const unsigned char *packed;
+    int packed_type;
+    ERL_NIF_TERM list;
+} input_column_t;
+
+// binds and executes the statement for each of `row_count` rows taken from the columns,
+// returns SQLITE_DONE, XQLITE_BADARG on malformed input, or an error code
+static int
+bind_step_columns(ErlNifEnv *env, sqlite3_stmt *stmt, input_column_t *columns, int count, size_t row_count)
+{
+    size_t bytes = 0;
+    int rc;
+
+    for (size_t row = 0; row < row_count; row++)
+    {
+        sqlite3_reset(stmt);
+
+        for (int i = 0; i < count; i++)
+        {
+            input_column_t *column = &columns[i];
+
+            if (column->packed && column->packed_type == SQLITE_INTEGER)
+            {
+                sqlite3_int64 i64;
+                memcpy(&i64, column->packed + row * sizeof(i64), sizeof(i64));
+                rc = sqlite3_bind_int64(stmt, i + 1, i64);
+            }
+            else if (column->packed)
+            {
+                double f64;
+                memcpy(&f64, column->packed + row * sizeof(f64), sizeof(f64));
+                rc = sqlite3_bind_double(stmt, i + 1, f64);
+            }
+            else
+            {
+                // list lengths are checked upfront
+                ERL_NIF_TERM param;
+                enif_get_list_cell(env, column->list, &param, &column->list);
+                rc = column->bind(env, stmt, i + 1, param, &bytes);
+            }
+
+            if (rc != SQLITE_OK)
+                return rc;
+        }
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_DONE)
+            return rc;
+    }
+
+    return SQLITE_DONE;
+}
+
+// reads a column for each parameter of the plan, all of the same length,
+// returns 0 on malformed input
+static int
+get_input_columns(ErlNifEnv *env, const plan_t *plan, ERL_NIF_TERM list, input_column_t *columns, size_t *row_count)
+{
+    ERL_NIF_TERM head;
+    *row_count = 0;
+
+    for (int i = 0; i < plan->count; i++)
+    {
+        if (!enif_get_list_cell(env, list, &head, &list))
+            return 0;
+
+        input_column_t *column = &columns[i];
+        column->bind = plan->binders[i];
+        column->packed = NULL;
+        column->packed_type = plan->types[i];
+        column->list = head;
+
+        size_t length;
+        ErlNifBinary packed;
+        unsigned int list_length;
+
+        if ((column->packed_type == SQLITE_INTEGER || column->packed_type == SQLITE_FLOAT) && enif_inspect_binary(env, head, &packed))
+        {
+            if (packed.size % sizeof(sqlite3_int64) != 0)
+                return 0;
+
+            column->packed = packed.data;
+            length = packed.size / sizeof(sqlite3_int64);
+        }
+        else if (enif_get_list_length(env, head, &list_length))
+        {
+            length = list_length;
+        }
+        else
+        {
+            return 0;
+        }
+
+        if (i == 0)
+            *row_count = length;
+        else if (length != *row_count)
+            return 0;
+    }
+
+    return enif_is_empty_list(env, list);
+}
+
+static ERL_NIF_TERM
+xqlite_insert_columns(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 3);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    plan_t *plan = get_plan(env, stmt->stmt, argv[1]);
+    if (!plan)
+        return enif_make_badarg(env);
+
+    // statements can have up to 32766 parameters, too many for the stack
+    int count = plan->count;
+    input_column_t *columns = enif_alloc(sizeof(input_column_t) * (count ? count : 1));
+    if (!columns)
+    {
+        enif_release_resource(plan);
+        return enif_raise_exception(env, am_out_of_memory);
+    }
+
+    size_t row_count;
+    int ok = get_input_columns(env, plan, argv[2], columns, &row_count);
+    enif_release_resource(plan);
+
+    if (!ok)
+    {
+        enif_free(columns);
+        return enif_make_badarg(env);
+    }
+
+    int rc = bind_step_columns(env, stmt->stmt, columns, count, row_count);
+    enif_free(columns);
+
+    // see insert_rows
+    clear_bindings(stmt);
+
+    switch (rc)
+    {
+    case SQLITE_DONE:
+        return am_done;
+
+    case XQLITE_BADARG:
+        return enif_make_badarg(env);
+
+    default:
+        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+    }
+}
+
+// steps the statement until it's done, adding rows to `rows`, the statement
+// is reset afterwards, returns SQLITE_DONE, XQLITE_NOMEM or an error code
+static int
+fetch_rows(ErlNifEnv *env, sqlite3_stmt *stmt, rows_t *rows)
+{
+    while (1)
+    {
+        int rc = sqlite3_step(stmt);
+        switch (rc)
+        {
+        case SQLITE_DONE:
+            sqlite3_reset(stmt);
+            return rc;
+
+        case SQLITE_ROW:
+            if (!rows_add(env, rows, stmt))
+            {
+                sqlite3_reset(stmt);
+                return XQLITE_NOMEM;
+            }
+            break;
+
+        default:
+            sqlite3_reset(stmt);
+            return rc;
+        }
+    }
+}
+
+static ERL_NIF_TERM
+xqlite_fetch_all(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    span_t span;
+    span_begin(&span, sqlite3_db_handle(stmt->stmt), stmt);
+
+    progress_t progress;
+    progress_begin(stmt, &progress, 0);
+
+    rows_t rows;
+    rows_init(&rows, stmt, enif_make_list_from_array(env, NULL, 0));
+    rows.count_bytes = span.telemetry != NULL;
+    int rc = fetch_rows(env, stmt->stmt, &rows);
+    uint64_t row_count = rows.row_count;
+    ERL_NIF_TERM result;
+
+    switch (rc)
+    {
+    case SQLITE_DONE:
+        result = rows_finish(env, &rows);
+        break;
+
+    case XQLITE_NOMEM:
+        rows_free(&rows);
+        result = enif_raise_exception(env, am_out_of_memory);
+        break;
+
+    default:
+        rows_free(&rows);
+        result = raise_step_error(env, stmt, &progress, rc);
+        break;
+    }
+
+    progress_end(&progress);
+    span_end(&span, XQLITE_OP_FETCH_ALL, rc, stmt, row_count, rows.bytes);
+    return result;
+}
+
+// number of rows stepped between timeslice checks in yielding_fetch_all
+#define XQLITE_YIELD_ROWS 64
+
+// VM instructions a single step of yielding_fetch_all may run on a regular
+// scheduler, roughly a tenth of a timeslice. Steps doing more work than that
+// before producing a row (sorting, aggregating) are moved to a dirty scheduler
+#define XQLITE_YIELD_STEP_OPS 100000
+
+// finishes yielding_fetch_all on a dirty scheduler, continuing from wherever the
+// statement is, argv is {stmt, reversed rows so far, deadline}
+static ERL_NIF_TERM
+xqlite_yielding_fetch_all_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 3);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt) || !stmt->stmt)
+        return enif_make_badarg(env);
+
+    ErlNifSInt64 deadline;
+    if (!enif_get_int64(env, argv[2], &deadline))
+        return enif_make_badarg(env);
+
+    progress_t progress;
+    progress_begin_at(stmt, &progress, 0, deadline);
+
+    rows_t rows;
+    rows_init(&rows, stmt, argv[1]);
+    rows.reverse = 1;
+
+    int rc = fetch_rows(env, stmt->stmt, &rows);
+    ERL_NIF_TERM result;
+
+    switch (rc)
+    {
+    case SQLITE_DONE:
+        result = rows_finish(env, &rows);
+        break;
+
+    case XQLITE_NOMEM:
+        rows_free(&rows);
+        result = enif_raise_exception(env, am_out_of_memory);
+        break;
+
+    default:
+        rows_free(&rows);
+        result = raise_step_error(env, stmt, &progress, rc);
+        break;
+    }
+
+    progress_end(&progress);
+    return result;
+}
+
+// steps rows on a regular scheduler until the timeslice is used up and reschedules
+// itself, argv is {stmt, reversed rows so far, deadline}. Only called for statements
+// that can be restarted from scratch, which is what happens on a dirty scheduler
+// when a single step runs over its budget
+static ERL_NIF_TERM
+xqlite_yielding_fetch_all_slice(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 3);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt) || !stmt->stmt)
+        return enif_make_badarg(env);
+
+    ErlNifSInt64 deadline;
+    if (!enif_get_int64(env, argv[2], &deadline))
+        return enif_make_badarg(env);
+
+    // see adaptive_step, the mutex is recursive so progress_begin_at doesn't block
+    sqlite3_mutex *mutex = sqlite3_db_mutex(sqlite3_db_handle(stmt->stmt));
+    if (sqlite3_mutex_try(mutex) != SQLITE_OK)
+        return enif_schedule_nif(env, "yielding_fetch_all_nif", ERL_NIF_DIRTY_JOB_IO_BOUND, xqlite_yielding_fetch_all_dirty, 3, argv);
+
+    progress_t progress;
+    progress_begin_at(stmt, &progress, XQLITE_YIELD_STEP_OPS, deadline);
+
+    // rows are accumulated in reverse across reschedules,
+    // in sub binary mode each slice of work gets its own arena
+    rows_t rows;
+    rows_init(&rows, stmt, argv[1]);
+    rows.reverse = 1;
+
+    ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+    int rc = SQLITE_ROW;
+
+    while (rc == SQLITE_ROW)
+    {
+        for (unsigned int step = 0; step < XQLITE_YIELD_ROWS; step++)
+        {
+            // the budget applies to each step, not to the whole slice
+            progress.ops = 0;
+            rc = sqlite3_step(stmt->stmt);
+            if (rc != SQLITE_ROW)
+                break;
+
+            if (!rows_add(env, &rows, stmt->stmt))
+            {
+                rc = XQLITE_NOMEM;
+                break;
+            }
+        }
+
+        if (rc != SQLITE_ROW)
+            break;
+
+        // a timeslice is roughly one millisecond
+        ErlNifTime now = enif_monotonic_time(ERL_NIF_USEC);
+        int percent = (int)((now - start) / 10);
+        if (percent < 1)
+            percent = 1;
+        else if (percent > 100)
+            percent = 100;
+
+        if (enif_consume_timeslice(env, percent))
+        {
+            progress_end(&progress);
+            sqlite3_mutex_leave(mutex);
+
+            ERL_NIF_TERM args[3] = {argv[0], rows_finish(env, &rows), argv[2]};
+            return enif_schedule_nif(env, "yielding_fetch_all_nif", 0, xqlite_yielding_fetch_all_slice, 3, args);
+        }
+
+        start = now;
+    }
+
+    // the rows so far are dropped and the dirty scheduler starts over
+    if (rc == SQLITE_INTERRUPT && progress.exceeded == XQLITE_PROGRESS_BUDGET)
+    {
+        rows_free(&rows);
+        sqlite3_reset(stmt->stmt);
+        progress_end(&progress);
+        sqlite3_mutex_leave(mutex);
+
+        ERL_NIF_TERM args[3] = {argv[0], enif_make_list_from_array(env, NULL, 0), argv[2]};
+        return enif_schedule_nif(env, "yielding_fetch_all_nif", ERL_NIF_DIRTY_JOB_IO_BOUND, xqlite_yielding_fetch_all_dirty, 3, args);
+    }
+
+    ERL_NIF_TERM result;
+    switch (rc)
+    {
+    case SQLITE_DONE:
+        sqlite3_reset(stmt->stmt);
+        // reversing is O(rows) and can't yield, so it's left to :lists.reverse/1
+        result = rows_finish(env, &rows);
+        break;
+
+    case XQLITE_NOMEM:
+        rows_free(&rows);
+        sqlite3_reset(stmt->stmt);
+        result = enif_raise_exception(env, am_out_of_memory);
+        break;
+
+    default:
+        rows_free(&rows);
+        sqlite3_reset(stmt->stmt);
+        result = raise_step_error(env, stmt, &progress, rc);
+        break;
+    }
+
+    progress_end(&progress);
+    sqlite3_mutex_leave(mutex);
+    return result;
+}
+
+// returns all rows in reverse order, starting on a regular scheduler if the
+// statement can be restarted (read-only and not yet stepped) and on a dirty one otherwise
+static ERL_NIF_TERM
+xqlite_yielding_fetch_all(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt) || !stmt->stmt)
+        return enif_make_badarg(env);
+
+    // the timeout covers the whole call, including reschedules
+    ERL_NIF_TERM args[3] = {argv[0], enif_make_list_from_array(env, NULL, 0), enif_make_int64(env, stmt_deadline(stmt))};
+
+    if (!sqlite3_stmt_readonly(stmt->stmt) || sqlite3_stmt_busy(stmt->stmt))
+        return enif_schedule_nif(env, "yielding_fetch_all_nif", ERL_NIF_DIRTY_JOB_IO_BOUND, xqlite_yielding_fetch_all_dirty, 3, args);
+
+    return xqlite_yielding_fetch_all_slice(env, 3, args);
+}
+
+static ERL_NIF_TERM
+make_column_names(ErlNifEnv *env, sqlite3_stmt *stmt)
+{
+    int column_count = sqlite3_column_count(stmt);
+    ERL_NIF_TERM columns[column_count];
+
+    for (unsigned int i = 0; i < column_count; i++)
+    {
+        const char *name = sqlite3_column_name(stmt, i);
+        if (!name)
+        {
+            columns[i] = am_nil;
+        }
+        else
+        {
+            columns[i] = make_binary(env, (unsigned char *)name, strlen(name));
+        }
+    }
+
+    return enif_make_list_from_array(env, columns, column_count);
+}
+
+// how a column's values are accumulated by fetch_columns
+enum
+{
+    COLUMN_EMPTY,
+    COLUMN_INTEGERS,
+    COLUMN_FLOATS,
+    COLUMN_TERMS,
+};
+
+// packed columns keep native 64 bit values until a cell of another type shows up
+typedef struct column
+{
+    int kind;
+    ErlNifBinary packed;
+    ERL_NIF_TERM *terms;
+    size_t capacity;
+} column_t;
+
+static void
+free_columns(column_t *columns, unsigned int column_count)
+{
+    for (unsigned int i = 0; i < column_count; i++)
+    {
+        if (columns[i].kind == COLUMN_INTEGERS || columns[i].kind == COLUMN_FLOATS)
+            enif_release_binary(&columns[i].packed);
+
+        enif_free(columns[i].terms);
+    }
+
+    enif_free(columns);
+}
+
+// turns already packed values into terms, returns 0 if out of memory
+static int
+unpack_column(ErlNifEnv *env, column_t *column, size_t row_count)
+{
+    size_t capacity = 0;
+    if (!grow_array((void **)&column->terms, &capacity, row_count + 1, sizeof(ERL_NIF_TERM)))
+        return 0;
+
+    for (size_t i = 0; i < row_count; i++)
+    {
+        if (column->kind == COLUMN_INTEGERS)
+            column->terms[i] = enif_make_int64(env, ((sqlite3_int64 *)column->packed.data)[i]);
+        else
+            column->terms[i] = enif_make_double(env, ((double *)column->packed.data)[i]);
+    }
+
+    if (column->kind != COLUMN_EMPTY)
+        enif_release_binary(&column->packed);
+
+    column->kind = COLUMN_TERMS;
+    column->capacity = capacity;
+    return 1;
+}
+
+// adds the current row to the columns, returns 0 if out of memory
+static int
+add_column_values(ErlNifEnv *env, column_t *columns, unsigned int column_count, sqlite3_stmt *stmt, size_t row)
+{
+    for (unsigned int i = 0; i < column_count; i++)
+    {
+        column_t *column = &columns[i];
+        int type = sqlite3_column_type(stmt, i);
+
+        if (column->kind == COLUMN_EMPTY && row == 0)
+        {
+            if (type == SQLITE_INTEGER || type == SQLITE_FLOAT)
+            {
+                if (!enif_alloc_binary(64 * sizeof(sqlite3_int64), &column->packed))
+                    return 0;
+
+                column->kind = type == SQLITE_INTEGER ? COLUMN_INTEGERS : COLUMN_FLOATS;
+                column->capacity = 64;
+            }
+        }
+
+        if ((column->kind == COLUMN_INTEGERS && type != SQLITE_INTEGER) ||
+            (column->kind == COLUMN_FLOATS && type != SQLITE_FLOAT) ||
+            column->kind == COLUMN_EMPTY)
+        {
+            if (!unpack_column(env, column, row))
+                return 0;
+        }
+
+        if (column->kind == COLUMN_TERMS)
+        {
+            if (!grow_array((void **)&column->terms, &column->capacity, row + 1, sizeof(ERL_NIF_TERM)))
+                return 0;
+
+            column->terms[row] = make_cell(env, stmt, i);
+            continue;
+        }
+
+        if (row == column->capacity)
+        {
+            if (!enif_realloc_binary(&column->packed, column->packed.size * 2))
+                return 0;
+
+            column->capacity *= 2;
+        }
+
+        if (column->kind == COLUMN_INTEGERS)
+            ((sqlite3_int64 *)column->packed.data)[row] = sqlite3_column_int64(stmt, i);
+        else
+            ((double *)column->packed.data)[row] = sqlite3_column_double(stmt, i);
+    }
+
+    return 1;
+}
+
+static ERL_NIF_TERM
+xqlite_fetch_columns(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    int packed;
+    if (!enif_get_int(env, argv[1], &packed))
+        return enif_make_badarg(env);
+
+    unsigned int column_count = sqlite3_column_count(stmt->stmt);
+    column_t *columns = enif_alloc(sizeof(column_t) * (column_count ? column_count : 1));
+    if (!columns)
+        return enif_raise_exception(env, am_out_of_memory);
+
+    memset(columns, 0, sizeof(column_t) * column_count);
+    for (unsigned int i = 0; i < column_count; i++)
+        columns[i].kind = packed ? COLUMN_EMPTY : COLUMN_TERMS;
+
+    size_t row_count = 0;
+    int rc;
+
+    progress_t progress;
+    progress_begin(stmt, &progress, 0);
+
+    while ((rc = sqlite3_step(stmt->stmt)) == SQLITE_ROW)
+    {
+        if (!add_column_values(env, columns, column_count, stmt->stmt, row_count))
+        {
+            sqlite3_reset(stmt->stmt);
+            progress_end(&progress);
+            free_columns(columns, column_count);
+            return enif_raise_exception(env, am_out_of_memory);
+        }
+
+        row_count++;
+    }
+
+    if (rc != SQLITE_DONE)
+    {
+        ERL_NIF_TERM error = raise_step_error(env, stmt, &progress, rc);
+        sqlite3_reset(stmt->stmt);
+        progress_end(&progress);
+        free_columns(columns, column_count);
+        return error;
+    }
+
+    sqlite3_reset(stmt->stmt);
+    progress_end(&progress);
+
+    ERL_NIF_TERM values[column_count];
+    for (unsigned int i = 0; i < column_count; i++)
+    {
+        column_t *column = &columns[i];
+        switch (column->kind)
+        {
+        case COLUMN_INTEGERS:
+        case COLUMN_FLOATS:
+            enif_realloc_binary(&column->packed, row_count * sizeof(sqlite3_int64));
+            values[i] = enif_make_binary(env, &column->packed);
+            column->kind = COLUMN_TERMS;
+            break;
+
+        case COLUMN_TERMS:
+            values[i] = enif_make_list_from_array(env, column->terms, row_count);
+            break;
+
+        default:
+            values[i] = enif_make_list_from_array(env, NULL, 0);
+            break;
+        }
+    }
+
+    free_columns(columns, column_count);
+
+    ERL_NIF_TERM names = make_column_names(env, stmt->stmt);
+    return enif_make_tuple2(env, names, enif_make_list_from_array(env, values, column_count));
+}
+
+static ERL_NIF_TERM
+xqlite_changes64(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    sqlite_int64 changes = sqlite3_changes64(db->db);
+    return enif_make_int64(env, changes);
+}
+
+static ERL_NIF_TERM
+xqlite_total_changes64(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    sqlite_int64 total_changes = sqlite3_total_changes64(db->db);
+    return enif_make_int64(env, total_changes);
+}
+
+static ERL_NIF_TERM
+xqlite_clear_bindings(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    int rc = clear_bindings(stmt);
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_enable_load_extension(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    int onoff;
+    if (!enif_get_int(env, argv[1], &onoff))
+        return enif_make_badarg(env);
+
+    int rc = sqlite3_enable_load_extension(db->db, onoff);
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, db->db);
+
+    return am_ok;
+}
+
+static ERL_NIF_TERM
+xqlite_sql(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    const char *sql = sqlite3_sql(stmt->stmt);
+    return make_binary(env, (unsigned char *)sql, strlen(sql));
+}
+
+static ERL_NIF_TERM
+xqlite_expanded_sql(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    const char *sql = sqlite3_expanded_sql(stmt->stmt);
+    ERL_NIF_TERM bin = make_binary(env, (unsigned char *)sql, strlen(sql));
+    sqlite3_free((void *)sql);
+    return bin;
+}
+
+static ERL_NIF_TERM
+xqlite_stmt_status(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt) || !stmt->stmt)
+        return enif_make_badarg(env);
+
+    int reset;
+    if (!enif_get_int(env, argv[1], &reset))
+        return enif_make_badarg(env);
+
+    static const struct
+    {
+        const char *name;
+        int op;
+    } counters[] = {
+        {"fullscan_step", SQLITE_STMTSTATUS_FULLSCAN_STEP},
+        {"sort", SQLITE_STMTSTATUS_SORT},
+        {"autoindex", SQLITE_STMTSTATUS_AUTOINDEX},
+        {"vm_step", SQLITE_STMTSTATUS_VM_STEP},
+        {"reprepare", SQLITE_STMTSTATUS_REPREPARE},
+        {"run", SQLITE_STMTSTATUS_RUN},
+        {"filter_miss", SQLITE_STMTSTATUS_FILTER_MISS},
+        {"filter_hit", SQLITE_STMTSTATUS_FILTER_HIT},
+        {"memused", SQLITE_STMTSTATUS_MEMUSED},
+    };
+
+    unsigned int count = sizeof(counters) / sizeof(counters[0]);
+    ERL_NIF_TERM keys[count];
+    ERL_NIF_TERM values[count];
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        keys[i] = enif_make_atom(env, counters[i].name);
+        values[i] = enif_make_int(env, sqlite3_stmt_status(stmt->stmt, counters[i].op, reset));
+    }
+
+    ERL_NIF_TERM status;
+    enif_make_map_from_arrays(env, keys, values, count, &status);
+    return status;
+}
+
+static ERL_NIF_TERM
+xqlite_scan_status(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt) || !stmt->stmt)
+        return enif_make_badarg(env);
+
+    int reset;
+    if (!enif_get_int(env, argv[1], &reset))
+        return enif_make_badarg(env);
+
+    ERL_NIF_TERM list = enif_make_list_from_array(env, NULL, 0);
+
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+    ERL_NIF_TERM keys[8] = {
+        enif_make_atom(env, "name"),
+        enif_make_atom(env, "explain"),
+        enif_make_atom(env, "loops"),
+        enif_make_atom(env, "rows"),
+        enif_make_atom(env, "estimate"),
+        enif_make_atom(env, "select_id"),
+        enif_make_atom(env, "parent_id"),
+        enif_make_atom(env, "cycles"),
+    };
+
+    int flags = SQLITE_SCANSTAT_COMPLEX;
+    const char *name;
+    const char *explain;
+    sqlite3_int64 loops, rows, cycles;
+    double estimate;
+    int select_id, parent_id;
+
+    // count the elements first so the list can be built from the last one
+    int count = 0;
+    while (sqlite3_stmt_scanstatus_v2(stmt->stmt, count, SQLITE_SCANSTAT_SELECTID, flags, &select_id) == 0)
+        count++;
+
+    for (int idx = count - 1; idx >= 0; idx--)
+    {
+        sqlite3_stmt_scanstatus_v2(stmt->stmt, idx, SQLITE_SCANSTAT_NAME, flags, &name);
+        sqlite3_stmt_scanstatus_v2(stmt->stmt, idx, SQLITE_SCANSTAT_EXPLAIN, flags, &explain);
+        sqlite3_stmt_scanstatus_v2(stmt->stmt, idx, SQLITE_SCANSTAT_NLOOP, flags, &loops);
+        sqlite3_stmt_scanstatus_v2(stmt->stmt, idx, SQLITE_SCANSTAT_NVISIT, flags, &rows);
+        sqlite3_stmt_scanstatus_v2(stmt->stmt, idx, SQLITE_SCANSTAT_EST, flags, &estimate);
+        sqlite3_stmt_scanstatus_v2(stmt->stmt, idx, SQLITE_SCANSTAT_SELECTID, flags, &select_id);
+        sqlite3_stmt_scanstatus_v2(stmt->stmt, idx, SQLITE_SCANSTAT_PARENTID, flags, &parent_id);
+        sqlite3_stmt_scanstatus_v2(stmt->stmt, idx, SQLITE_SCANSTAT_NCYCLE, flags, &cycles);
+
+        ERL_NIF_TERM values[8] = {
+            name ? make_binary(env, (const unsigned char *)name, strlen(name)) : am_nil,
+            explain ? make_binary(env, (const unsigned char *)explain, strlen(explain)) : am_nil,
+            enif_make_int64(env, loops),
+            enif_make_int64(env, rows),
+            enif_make_double(env, estimate),
+            enif_make_int(env, select_id),
+            enif_make_int(env, parent_id),
+            enif_make_int64(env, cycles),
+        };
+
+        ERL_NIF_TERM element;
+        enif_make_map_from_arrays(env, keys, values, 8, &element);
+        list = enif_make_list_cell(env, element, list);
+    }
+
+    if (reset)
+        sqlite3_stmt_scanstatus_reset(stmt->stmt);
+#endif
+
+    return list;
+}
+
+static ERL_NIF_TERM
+xqlite_get_autocommit(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    int autocommit = sqlite3_get_autocommit(db->db);
+    return enif_make_int(env, autocommit);
+}
+
+static ERL_NIF_TERM
+xqlite_last_insert_rowid(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+        return enif_make_badarg(env);
+
+    sqlite3_int64 last_insert_rowid = sqlite3_last_insert_rowid(db->db);
+    return enif_make_int64(env, last_insert_rowid);
+}
+
+static ERL_NIF_TERM
+xqlite_memory_used(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 0);
+    sqlite3_int64 memory_used = sqlite3_memory_used();
+    return enif_make_int64(env, memory_used);
+}
+
+static ERL_NIF_TERM
+xqlite_status(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    int reset;
+    if (!enif_get_int(env, argv[0], &reset))
+        return enif_make_badarg(env);
+
+    static const struct
+    {
+        const char *name;
+        int op;
+    } counters[] = {
+        {"memory_used", SQLITE_STATUS_MEMORY_USED},
+        {"malloc_size", SQLITE_STATUS_MALLOC_SIZE},
+        {"malloc_count", SQLITE_STATUS_MALLOC_COUNT},
+        {"pagecache_used", SQLITE_STATUS_PAGECACHE_USED},
+        {"pagecache_overflow", SQLITE_STATUS_PAGECACHE_OVERFLOW},
+        {"pagecache_size", SQLITE_STATUS_PAGECACHE_SIZE},
+        {"parser_stack", SQLITE_STATUS_PARSER_STACK},
+    };
+
+    unsigned int count = sizeof(counters) / sizeof(counters[0]);
+    ERL_NIF_TERM keys[count];
+    ERL_NIF_TERM values[count];
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        sqlite3_int64 current = 0, highwater = 0;
+        sqlite3_status64(counters[i].op, &current, &highwater, reset);
+
+        keys[i] = enif_make_atom(env, counters[i].name);
+        values[i] = enif_make_tuple2(env, enif_make_int64(env, current), enif_make_int64(env, highwater));
+    }
+
+    ERL_NIF_TERM status;
+    enif_make_map_from_arrays(env, keys, values, count, &status);
+    return status;
+}
+
+static ERL_NIF_TERM
+xqlite_db_status(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 2);
+
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db) || !db->db)
+        return enif_make_badarg(env);
+
+    int reset;
+    if (!enif_get_int(env, argv[1], &reset))
+        return enif_make_badarg(env);
+
+    // some counters report through the highwater mark and leave the current value at zero
+    static const struct
+    {
+        const char *name;
+        int op;
+        int highwater;
+    } counters[] = {
+        {"cache_used", SQLITE_DBSTATUS_CACHE_USED, 0},
+        {"cache_used_shared", SQLITE_DBSTATUS_CACHE_USED_SHARED, 0},
+        {"cache_hit", SQLITE_DBSTATUS_CACHE_HIT, 0},
+        {"cache_miss", SQLITE_DBSTATUS_CACHE_MISS, 0},
+        {"cache_write", SQLITE_DBSTATUS_CACHE_WRITE, 0},
+        {"cache_spill", SQLITE_DBSTATUS_CACHE_SPILL, 0},
+        {"schema_used", SQLITE_DBSTATUS_SCHEMA_USED, 0},
+        {"stmt_used", SQLITE_DBSTATUS_STMT_USED, 0},
+        {"deferred_fks", SQLITE_DBSTATUS_DEFERRED_FKS, 0},
+        {"lookaside_used", SQLITE_DBSTATUS_LOOKASIDE_USED, 0},
+        {"lookaside_highwater", SQLITE_DBSTATUS_LOOKASIDE_USED, 1},
+        {"lookaside_hit", SQLITE_DBSTATUS_LOOKASIDE_HIT, 1},
+        {"lookaside_miss_size", SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, 1},
+        {"lookaside_miss_full", SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, 1},
+    };
+
+    unsigned int count = sizeof(counters) / sizeof(counters[0]);
+    ERL_NIF_TERM keys[count];
+    ERL_NIF_TERM values[count];
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        int current = 0, highwater = 0;
+        // lookaside_used is read twice, reset it on the second read only
+        int reset_counter = reset && !(counters[i].op == SQLITE_DBSTATUS_LOOKASIDE_USED && !counters[i].highwater);
+        sqlite3_db_status(db->db, counters[i].op, &current, &highwater, reset_counter);
+
+        keys[i] = enif_make_atom(env, counters[i].name);
+        values[i] = enif_make_int(env, counters[i].highwater ? highwater : current);
+    }
+
+    ERL_NIF_TERM status;
+    enif_make_map_from_arrays(env, keys, values, count, &status);
+    return status;
+}
+
+static ERL_NIF_TERM
+xqlite_column_count(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
 
-    if (stmt->stmt)
-    {
-        sqlite3_finalize(stmt->stmt);
-        stmt->stmt = NULL;
-    }
+    int column_count = sqlite3_column_count(stmt->stmt);
+    return enif_make_int(env, column_count);
 }
 
-static int
-on_load(ErlNifEnv *env, void **priv, ERL_NIF_TERM info)
+static ERL_NIF_TERM
+xqlite_column_name(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    assert(env);
-
-    am_ok = enif_make_atom(env, "ok");
-    am_xqlite = enif_make_atom(env, "xqlite");
-    am_nil = enif_make_atom(env, "nil");
-    // TODO rename to alloc_error
-    am_out_of_memory = enif_make_atom(env, "out_of_memory");
-    am_done = enif_make_atom(env, "done");
-    am_row = enif_make_atom(env, "row");
-    am_rows = enif_make_atom(env, "rows");
+    assert(argc == 2);
 
-    sqlite3_config(SQLITE_CONFIG_GETMALLOC, &default_mem_methods);
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
 
-    db_type = enif_open_resource_type(env, "xqlite", "db_type", db_type_destructor, ERL_NIF_RT_CREATE, NULL);
-    if (!db_type)
-        return -1;
+    int idx;
+    if (!enif_get_int(env, argv[1], &idx))
+        return enif_make_badarg(env);
 
-    stmt_type = enif_open_resource_type(env, "xqlite", "stmt_type", stmt_type_destructor, ERL_NIF_RT_CREATE, NULL);
-    if (!stmt_type)
-        return -1;
+    const char *name = sqlite3_column_name(stmt->stmt, idx);
+    if (!name)
+        return am_nil;
 
-    return 0;
+    return make_binary(env, (unsigned char *)name, strlen(name));
 }
 
-static void
-on_unload(ErlNifEnv *caller_env, void *priv_data)
+static ERL_NIF_TERM
+xqlite_column_names(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    assert(caller_env);
-    sqlite3_config(SQLITE_CONFIG_MALLOC, &default_mem_methods);
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    return make_column_names(env, stmt->stmt);
 }
 
 static ERL_NIF_TERM
-make_binary(ErlNifEnv *env, const unsigned char *bytes, size_t size)
+xqlite_bind_parameter_count(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    ERL_NIF_TERM bin;
-    uint8_t *data = enif_make_new_binary(env, size, &bin);
-    memcpy(data, bytes, size);
-    return bin;
+    assert(argc == 1);
+
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
+
+    int bind_parameter_count = sqlite3_bind_parameter_count(stmt->stmt);
+    return enif_make_int(env, bind_parameter_count);
 }
 
-// TODO just return rc, and let caller handle error, export the necessary nifs
 static ERL_NIF_TERM
-raise_sqlite3_error(ErlNifEnv *env, int rc, sqlite3 *db)
+xqlite_bind_parameter_index(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    const char *msg = sqlite3_errmsg(db);
+    assert(argc == 2);
 
-    if (!msg)
-        msg = sqlite3_errstr(rc);
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+        return enif_make_badarg(env);
 
-    ERL_NIF_TERM code = enif_make_int64(env, rc);
-    ERL_NIF_TERM reason = enif_make_string(env, msg, ERL_NIF_UTF8);
-    ERL_NIF_TERM error = enif_make_tuple3(env, am_xqlite, code, reason);
-    return enif_raise_exception(env, error);
+    ErlNifBinary name;
+    if (!enif_inspect_binary(env, argv[1], &name))
+        return enif_make_badarg(env);
+
+    int idx = sqlite3_bind_parameter_index(stmt->stmt, (char *)name.data);
+    return enif_make_int(env, idx);
 }
 
 static ERL_NIF_TERM
-xqlite_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_bind_parameter_name(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     assert(argc == 2);
 
-    ErlNifBinary path;
-    if (!enif_inspect_binary(env, argv[0], &path))
+    stmt_t *stmt;
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
         return enif_make_badarg(env);
 
-    int flags;
-    if (!enif_get_int(env, argv[1], &flags))
+    int idx;
+    if (!enif_get_int(env, argv[1], &idx))
         return enif_make_badarg(env);
 
-    db_t *db = enif_alloc_resource(db_type, sizeof(db_t));
-    if (!db)
-        return enif_raise_exception(env, am_out_of_memory);
-
-    int rc = sqlite3_open_v2((char *)path.data, &db->db, flags, NULL);
-    if (rc != SQLITE_OK)
-    {
-        enif_release_resource(db);
-        const char *msg = sqlite3_errstr(rc);
-        ERL_NIF_TERM code = enif_make_int64(env, rc);
-        ERL_NIF_TERM reason = enif_make_string(env, msg, ERL_NIF_UTF8);
-        ERL_NIF_TERM error = enif_make_tuple3(env, am_xqlite, code, reason);
-        return enif_raise_exception(env, error);
-    }
+    const char *name = sqlite3_bind_parameter_name(stmt->stmt, idx);
+    if (!name)
+        return am_nil;
 
-    ERL_NIF_TERM result = enif_make_resource(env, db);
-    enif_release_resource(db);
-    return result;
+    return make_binary(env, (unsigned char *)name, strlen(name));
 }
 
 static ERL_NIF_TERM
-xqlite_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_exec(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    assert(argc == 1);
+    assert(argc == 2);
 
     db_t *db;
     if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
         return enif_make_badarg(env);
 
-    // DB is already closed, nothing to do here
-    if (db->db == NULL)
-        return am_ok;
+    ErlNifBinary sql;
+    if (!enif_inspect_binary(env, argv[1], &sql))
+        return enif_make_badarg(env);
 
-    int autocommit = sqlite3_get_autocommit(db->db);
-    if (autocommit == 0)
-    {
-        int rc = sqlite3_exec(db->db, "ROLLBACK;", NULL, NULL, NULL);
-        if (rc != SQLITE_OK)
-            return raise_sqlite3_error(env, rc, db->db);
-    }
+    span_t span;
+    span_begin(&span, db->db, NULL);
+
+    int rc = sqlite3_exec(db->db, (char *)sql.data, NULL, NULL, NULL);
+    span_end(&span, XQLITE_OP_EXEC, rc, NULL, 0, 0);
 
-    // note: _v2 may not fully close the connection, hence why we check if
-    // any transaction is open above, to make sure other connections aren't
-    // blocked. v1 is guaranteed to close or error, but will return error if any
-    // unfinalized statements, which we likely have, as we rely on the destructors
-    // to later run to clean those up
-    int rc = sqlite3_close_v2(db->db);
     if (rc != SQLITE_OK)
         return raise_sqlite3_error(env, rc, db->db);
 
-    db->db = NULL;
     return am_ok;
 }
 
 static ERL_NIF_TERM
-xqlite_prepare(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_set_telemetry(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    assert(argc == 3);
+    assert(argc == 2);
 
     db_t *db;
-    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db) || !db->db)
         return enif_make_badarg(env);
 
-    ErlNifBinary sql;
-    if (!enif_inspect_binary(env, argv[1], &sql))
+    unsigned int capacity;
+    if (!enif_get_uint(env, argv[1], &capacity))
         return enif_make_badarg(env);
 
-    int flags;
-    if (!enif_get_int(env, argv[2], &flags))
-        return enif_make_badarg(env);
+    telemetry_t *telemetry = atomic_load(&db->telemetry);
 
-    stmt_t *stmt;
-    stmt = enif_alloc_resource(stmt_type, sizeof(stmt_t));
-    if (!stmt)
-        return enif_raise_exception(env, am_out_of_memory);
+    if (!capacity)
+    {
+        if (telemetry)
+            telemetry_enable(telemetry, 0);
 
-    int rc = sqlite3_prepare_v3(db->db, (char *)sql.data, sql.size, flags, &stmt->stmt, NULL);
-    if (rc != SQLITE_OK)
+        return am_ok;
+    }
+
+    if (!telemetry)
     {
-        enif_release_resource(stmt);
-        return raise_sqlite3_error(env, rc, db->db);
+        telemetry = telemetry_alloc(capacity);
+        if (!telemetry)
+            return enif_raise_exception(env, am_out_of_memory);
+
+        telemetry_t *existing = NULL;
+        if (!atomic_compare_exchange_strong(&db->telemetry, &existing, telemetry))
+        {
+            enif_free(telemetry);
+            telemetry = existing;
+        }
+        else
+        {
+            // the connection's reference, sqlite releases it on close or if registering fails
+            atomic_fetch_add(&telemetry->refs, 1);
+            int rc = sqlite3_set_clientdata(db->db, XQLITE_TELEMETRY, telemetry, telemetry_release);
+            if (rc != SQLITE_OK)
+                return raise_sqlite3_error(env, rc, db->db);
+        }
     }
 
-    ERL_NIF_TERM result = enif_make_resource(env, stmt);
-    enif_release_resource(stmt);
-    return result;
+    // producers write into the buffer without a lock, so it can't be swapped for
+    // one of another size while the connection is open
+    if (telemetry->capacity != capacity)
+        return enif_make_badarg(env);
+
+    telemetry_enable(telemetry, 1);
+    return am_ok;
 }
 
+// returns up to `max` recorded events, oldest first, and the number
+// of events dropped because the buffer was full since the last drain
 static ERL_NIF_TERM
-xqlite_bind_text(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_drain_telemetry(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    assert(argc == 3);
+    assert(argc == 2);
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
         return enif_make_badarg(env);
 
-    unsigned int idx;
-    if (!enif_get_uint(env, argv[1], &idx))
+    unsigned int max;
+    if (!enif_get_uint(env, argv[1], &max))
         return enif_make_badarg(env);
 
-    ErlNifBinary text;
-    if (!enif_inspect_binary(env, argv[2], &text))
-        return enif_make_badarg(env);
+    ERL_NIF_TERM events = enif_make_list_from_array(env, NULL, 0);
+    telemetry_t *telemetry = atomic_load(&db->telemetry);
 
-    int rc = sqlite3_bind_text(stmt->stmt, idx, (char *)text.data, text.size, SQLITE_TRANSIENT);
-    if (rc != SQLITE_OK)
-        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+    if (!telemetry)
+        return enif_make_tuple2(env, events, enif_make_uint64(env, 0));
 
-    return am_ok;
+    static const char *ops[] = {"step", "fetch_all", "insert_all", "exec"};
+    telemetry_event_t event;
+
+    for (unsigned int i = 0; i < max && telemetry_pop(telemetry, &event); i++)
+    {
+        ERL_NIF_TERM values[7] = {
+            enif_make_atom(env, ops[event.op]),
+            enif_make_int64(env, event.start),
+            enif_make_int64(env, event.duration),
+            enif_make_uint64(env, event.rows),
+            enif_make_uint64(env, event.vm_steps),
+            enif_make_uint64(env, event.bytes),
+            enif_make_int(env, event.rc),
+        };
+
+        events = enif_make_list_cell(env, enif_make_tuple_from_array(env, values, 7), events);
+    }
+
+    ERL_NIF_TERM reversed;
+    enif_make_reverse_list(env, events, &reversed);
+
+    uint64_t dropped = atomic_exchange(&telemetry->dropped, 0);
+    return enif_make_tuple2(env, reversed, enif_make_uint64(env, dropped));
 }
 
-static ERL_NIF_TERM
-xqlite_bind_blob(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// statements slower than a threshold reported by SQLITE_TRACE_PROFILE, kept in
+// a buffer where the newest entries replace the oldest ones once full. Owned by
+// the connection's client data, since the trace callback fires for as long as
+// the connection is open
+typedef struct slow_query
 {
-    assert(argc == 3);
+    char *sql;
+    sqlite3_int64 ns;
+} slow_query_t;
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
+typedef struct slow_log
+{
+    ErlNifMutex *lock;
+    sqlite3_int64 threshold;
+    // with a pid, a sender thread takes the entries and sends them. The trace
+    // callback runs on scheduler threads, where enif_send needs a caller env
+    // that the callback doesn't have
+    int send;
+    int stopping;
+    ErlNifPid pid;
+    ErlNifCond *cond;
+    ErlNifTid tid;
+    unsigned int capacity;
+    unsigned int start;
+    unsigned int count;
+    uint64_t dropped;
+    slow_query_t entries[];
+} slow_log_t;
+
+#define XQLITE_SLOW_LOG "xqlite_slow_log"
 
-    unsigned int idx;
-    if (!enif_get_uint(env, argv[1], &idx))
-        return enif_make_badarg(env);
+static void
+slow_log_free(void *arg)
+{
+    slow_log_t *log = (slow_log_t *)arg;
 
-    ErlNifBinary blob;
-    if (!enif_inspect_binary(env, argv[2], &blob))
-        return enif_make_badarg(env);
+    if (log->send)
+    {
+        // the sender delivers what's left before it exits
+        enif_mutex_lock(log->lock);
+        log->stopping = 1;
+        enif_cond_signal(log->cond);
+        enif_mutex_unlock(log->lock);
+
+        enif_thread_join(log->tid, NULL);
+        enif_cond_destroy(log->cond);
+    }
 
-    int rc = sqlite3_bind_blob(stmt->stmt, idx, (char *)blob.data, blob.size, SQLITE_TRANSIENT);
-    if (rc != SQLITE_OK)
-        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+    for (unsigned int i = 0; i < log->count; i++)
+        sqlite3_free(log->entries[(log->start + i) % log->capacity].sql);
 
-    return am_ok;
+    enif_mutex_destroy(log->lock);
+    enif_free(log);
 }
 
-static ERL_NIF_TERM
-xqlite_bind_integer(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+static int
+slow_log_trace(unsigned int type, void *ctx, void *p, void *x)
 {
-    assert(argc == 3);
+    slow_log_t *log = (slow_log_t *)ctx;
+    sqlite3_stmt *stmt = (sqlite3_stmt *)p;
+    sqlite3_int64 ns = *(sqlite3_int64 *)x;
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
+    if (type != SQLITE_TRACE_PROFILE || ns < log->threshold)
+        return 0;
 
-    unsigned int idx;
-    if (!enif_get_uint(env, argv[1], &idx))
-        return enif_make_badarg(env);
+    // expanding fails on OOM or when the result exceeds SQLITE_LIMIT_LENGTH
+    char *sql = sqlite3_expanded_sql(stmt);
+    if (!sql)
+        sql = sqlite3_mprintf("%s", sqlite3_sql(stmt));
 
-    int rc;
-    int i32;
-    ErlNifSInt64 i64;
-    ERL_NIF_TERM param = argv[2];
+    if (!sql)
+        return 0;
 
-    if (enif_get_int(env, param, &i32))
-    {
-        rc = sqlite3_bind_int(stmt->stmt, idx, i32);
-    }
-    else if (enif_get_int64(env, param, &i64))
+    enif_mutex_lock(log->lock);
+
+    if (log->count == log->capacity)
     {
-        rc = sqlite3_bind_int64(stmt->stmt, idx, i64);
+        sqlite3_free(log->entries[log->start].sql);
+        log->start = (log->start + 1) % log->capacity;
+        log->count--;
+        log->dropped++;
     }
-    else
+
+    slow_query_t *entry = &log->entries[(log->start + log->count) % log->capacity];
+    entry->sql = sql;
+    entry->ns = ns;
+    log->count++;
+
+    if (log->send)
+        enif_cond_signal(log->cond);
+
+    enif_mutex_unlock(log->lock);
+    return 0;
+}
+
+// sends the entries of a log with a pid as {xqlite_slow_query, sql, ns} messages,
+// runs until slow_log_free stops it
+static void *
+slow_log_sender(void *arg)
+{
+    slow_log_t *log = (slow_log_t *)arg;
+
+    enif_mutex_lock(log->lock);
+
+    while (1)
     {
-        return enif_make_badarg(env);
+        while (!log->count && !log->stopping)
+            enif_cond_wait(log->cond, log->lock);
+
+        // stopping and the buffer is drained
+        if (!log->count)
+            break;
+
+        slow_query_t entry = log->entries[log->start];
+        log->start = (log->start + 1) % log->capacity;
+        log->count--;
+        enif_mutex_unlock(log->lock);
+
+        ErlNifEnv *msg_env = enif_alloc_env();
+        if (msg_env)
+        {
+            ERL_NIF_TERM sql = make_binary(msg_env, (unsigned char *)entry.sql, strlen(entry.sql));
+            ERL_NIF_TERM msg = enif_make_tuple3(msg_env, enif_make_atom(msg_env, "xqlite_slow_query"), sql, enif_make_int64(msg_env, entry.ns));
+            enif_send(NULL, &log->pid, msg_env, msg);
+            enif_free_env(msg_env);
+        }
+
+        sqlite3_free(entry.sql);
+        enif_mutex_lock(log->lock);
     }
 
-    if (rc != SQLITE_OK)
-        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+    enif_mutex_unlock(log->lock);
 
-    return am_ok;
+    // the entries were allocated by SQLite on other threads but freed here
+    xqlite_mem_flush();
+    return NULL;
 }
 
 static ERL_NIF_TERM
-xqlite_bind_float(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_set_slow_log(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    assert(argc == 3);
+    assert(argc == 4);
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db) || !db->db)
         return enif_make_badarg(env);
 
-    unsigned int idx;
-    if (!enif_get_uint(env, argv[1], &idx))
+    ErlNifSInt64 threshold;
+    if (!enif_get_int64(env, argv[1], &threshold))
         return enif_make_badarg(env);
 
-    double f64;
-    if (!enif_get_double(env, argv[2], &f64))
+    unsigned int capacity;
+    if (!enif_get_uint(env, argv[2], &capacity) || !capacity)
         return enif_make_badarg(env);
 
-    int rc = sqlite3_bind_double(stmt->stmt, idx, f64);
-    if (rc != SQLITE_OK)
-        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+    ErlNifPid pid;
+    int send = enif_get_local_pid(env, argv[3], &pid);
+    if (!send && !enif_is_identical(argv[3], am_nil))
+        return enif_make_badarg(env);
 
-    return am_ok;
-}
+    // a negative threshold turns the log off and frees the previous one
+    if (threshold < 0)
+    {
+        sqlite3_trace_v2(db->db, 0, NULL, NULL);
+        sqlite3_set_clientdata(db->db, XQLITE_SLOW_LOG, NULL, NULL);
+        return am_ok;
+    }
 
-static ERL_NIF_TERM
-xqlite_bind_null(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    assert(argc == 2);
+    slow_log_t *log = enif_alloc(sizeof(slow_log_t) + sizeof(slow_query_t) * capacity);
+    if (!log)
+        return enif_raise_exception(env, am_out_of_memory);
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
+    memset(log, 0, sizeof(slow_log_t));
+    log->threshold = threshold;
+    log->send = send;
+    if (send)
+        log->pid = pid;
+    log->capacity = capacity;
+    log->lock = enif_mutex_create("xqlite_slow_log");
+    if (!log->lock)
+    {
+        enif_free(log);
+        return enif_raise_exception(env, am_out_of_memory);
+    }
 
-    unsigned int idx;
-    if (!enif_get_uint(env, argv[1], &idx))
-        return enif_make_badarg(env);
+    if (send)
+    {
+        log->cond = enif_cond_create("xqlite_slow_log");
+        if (!log->cond || enif_thread_create("xqlite_slow_log", &log->tid, slow_log_sender, log, NULL) != 0)
+        {
+            if (log->cond)
+                enif_cond_destroy(log->cond);
+            enif_mutex_destroy(log->lock);
+            enif_free(log);
+            return enif_raise_exception(env, am_out_of_memory);
+        }
+    }
 
-    int rc = sqlite3_bind_null(stmt->stmt, idx);
+    // both calls take the connection mutex, so the previous log (freed when
+    // its client data is replaced) is no longer in use by the trace callback
+    sqlite3_trace_v2(db->db, SQLITE_TRACE_PROFILE, slow_log_trace, log);
 
+    int rc = sqlite3_set_clientdata(db->db, XQLITE_SLOW_LOG, log, slow_log_free);
     if (rc != SQLITE_OK)
-        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+    {
+        sqlite3_trace_v2(db->db, 0, NULL, NULL);
+        return raise_sqlite3_error(env, rc, db->db);
+    }
 
     return am_ok;
 }
 
+// returns the captured slow statements, oldest first, and the
+// number of entries overwritten since the last call
 static ERL_NIF_TERM
-xqlite_reset(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_slow_queries(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     assert(argc == 1);
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
         return enif_make_badarg(env);
 
-    // TODO don't raise twice
-    int rc = sqlite3_reset(stmt->stmt);
-    if (rc != SQLITE_OK)
-        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+    ERL_NIF_TERM list = enif_make_list_from_array(env, NULL, 0);
+    if (!db->db)
+        return enif_make_tuple2(env, list, enif_make_uint64(env, 0));
 
-    return am_ok;
+    // set_slow_query_log frees the previous log when it replaces the client data,
+    // which it does while holding the connection mutex
+    sqlite3_mutex *mutex = sqlite3_db_mutex(db->db);
+    sqlite3_mutex_enter(mutex);
+
+    slow_log_t *log = sqlite3_get_clientdata(db->db, XQLITE_SLOW_LOG);
+    if (!log)
+    {
+        sqlite3_mutex_leave(mutex);
+        return enif_make_tuple2(env, list, enif_make_uint64(env, 0));
+    }
+
+    enif_mutex_lock(log->lock);
+
+    for (unsigned int i = log->count; i > 0; i--)
+    {
+        slow_query_t *entry = &log->entries[(log->start + i - 1) % log->capacity];
+        ERL_NIF_TERM sql = make_binary(env, (unsigned char *)entry->sql, strlen(entry->sql));
+        ERL_NIF_TERM entry_term = enif_make_tuple2(env, sql, enif_make_int64(env, entry->ns));
+        list = enif_make_list_cell(env, entry_term, list);
+        sqlite3_free(entry->sql);
+    }
+
+    uint64_t dropped = log->dropped;
+    log->start = 0;
+    log->count = 0;
+    log->dropped = 0;
+
+    enif_mutex_unlock(log->lock);
+    sqlite3_mutex_leave(mutex);
+    return enif_make_tuple2(env, list, enif_make_uint64(env, dropped));
 }
 
-static ERL_NIF_TERM
-make_cell(ErlNifEnv *env, sqlite3_stmt *stmt, unsigned int idx)
+// binds a term inferring its type: integers, floats, binaries as text, {blob, binary},
+// nil as NULL and booleans as 1 and 0, returns XQLITE_BADARG for other terms
+static int
+bind_term(ErlNifEnv *env, sqlite3_stmt *stmt, int idx, ERL_NIF_TERM term)
 {
-    switch (sqlite3_column_type(stmt, idx))
-    {
-    case SQLITE_INTEGER:
-        // TODO maybe use enif_make_int if possible?
-        return enif_make_int64(env, sqlite3_column_int64(stmt, idx));
+    ErlNifSInt64 i64;
+    double f64;
+    ErlNifBinary bin;
+    const ERL_NIF_TERM *tuple;
+    int arity;
 
-    case SQLITE_FLOAT:
-        return enif_make_double(env, sqlite3_column_double(stmt, idx));
+    if (enif_get_int64(env, term, &i64))
+        return sqlite3_bind_int64(stmt, idx, i64);
 
-    case SQLITE_TEXT:
-        return make_binary(env, sqlite3_column_text(stmt, idx), sqlite3_column_bytes(stmt, idx));
+    if (enif_get_double(env, term, &f64))
+        return sqlite3_bind_double(stmt, idx, f64);
 
-    case SQLITE_BLOB:
-        return make_binary(env, sqlite3_column_blob(stmt, idx), sqlite3_column_bytes(stmt, idx));
+    if (enif_inspect_binary(env, term, &bin))
+        return sqlite3_bind_text(stmt, idx, (char *)bin.data, bin.size, SQLITE_STATIC);
 
-    case SQLITE_NULL:
-        return am_nil;
+    if (enif_is_identical(term, am_nil))
+        return sqlite3_bind_null(stmt, idx);
 
-    // TODO
-    default:
-        return am_nil;
-    }
+    if (enif_is_identical(term, am_true))
+        return sqlite3_bind_int(stmt, idx, 1);
+
+    if (enif_is_identical(term, am_false))
+        return sqlite3_bind_int(stmt, idx, 0);
+
+    if (enif_get_tuple(env, term, &arity, &tuple) && arity == 2 &&
+        enif_is_identical(tuple[0], am_blob) && enif_inspect_binary(env, tuple[1], &bin))
+        return sqlite3_bind_blob(stmt, idx, (char *)bin.data, bin.size, SQLITE_STATIC);
+
+    return XQLITE_BADARG;
 }
 
-static ERL_NIF_TERM
-make_row(ErlNifEnv *env, unsigned int column_count, sqlite3_stmt *stmt)
+// resets the statement and binds a list of params with bind_term, the list length
+// must match the parameter count, returns SQLITE_OK, XQLITE_BADARG or an error code
+static int
+bind_params(ErlNifEnv *env, sqlite3_stmt *stmt, ERL_NIF_TERM params)
 {
-    assert(env);
-    assert(stmt);
-
-    // TODO lol this is a bit silly, but it's a start
-    switch (column_count)
-    {
-    case 0:
-        return enif_make_list(env, 0);
-    case 1:
-        return enif_make_list(env, 1, make_cell(env, stmt, 0));
-    case 2:
-        return enif_make_list(env, 2, make_cell(env, stmt, 0),
-                              make_cell(env, stmt, 1));
-    case 3:
-        return enif_make_list(env, 3, make_cell(env, stmt, 0),
-                              make_cell(env, stmt, 1), make_cell(env, stmt, 2));
-    case 4:
-        return enif_make_list(env, 4, make_cell(env, stmt, 0),
-                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
-                              make_cell(env, stmt, 3));
-    case 5:
-        return enif_make_list(env, 5, make_cell(env, stmt, 0),
-                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
-                              make_cell(env, stmt, 3), make_cell(env, stmt, 4));
-    case 6:
-        return enif_make_list(env, 6, make_cell(env, stmt, 0),
-                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
-                              make_cell(env, stmt, 3), make_cell(env, stmt, 4),
-                              make_cell(env, stmt, 5));
-    case 7:
-        return enif_make_list(env, 7, make_cell(env, stmt, 0),
-                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
-                              make_cell(env, stmt, 3), make_cell(env, stmt, 4),
-                              make_cell(env, stmt, 5), make_cell(env, stmt, 6));
-    case 8:
-        return enif_make_list(env, 8, make_cell(env, stmt, 0),
-                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
-                              make_cell(env, stmt, 3), make_cell(env, stmt, 4),
-                              make_cell(env, stmt, 5), make_cell(env, stmt, 6),
-                              make_cell(env, stmt, 7));
-    case 9:
-        return enif_make_list(env, 9, make_cell(env, stmt, 0),
-                              make_cell(env, stmt, 1), make_cell(env, stmt, 2),
-                              make_cell(env, stmt, 3), make_cell(env, stmt, 4),
-                              make_cell(env, stmt, 5), make_cell(env, stmt, 6),
-                              make_cell(env, stmt, 7), make_cell(env, stmt, 8));
-    // TODO continue till 16
-    default:
-    {
-        ERL_NIF_TERM *columns;
-        columns = enif_alloc(sizeof(ERL_NIF_TERM) * column_count);
-        if (!columns)
-            return enif_raise_exception(env, am_out_of_memory);
+    unsigned int count;
+    if (!enif_get_list_length(env, params, &count) || count != sqlite3_bind_parameter_count(stmt))
+        return XQLITE_BADARG;
 
-        for (unsigned int i = 0; i < column_count; i++)
-            columns[i] = make_cell(env, stmt, i);
+    sqlite3_reset(stmt);
 
-        ERL_NIF_TERM row = enif_make_list_from_array(env, columns, column_count);
-        enif_free(columns);
-        return row;
-    }
+    int rc = SQLITE_OK;
+    ERL_NIF_TERM param;
+    for (unsigned int i = 1; i <= count && rc == SQLITE_OK; i++)
+    {
+        enif_get_list_cell(env, params, &param, &params);
+        rc = bind_term(env, stmt, i, param);
     }
+
+    return rc;
 }
 
-static ERL_NIF_TERM
-xqlite_step(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// finds the index of a named parameter by an atom or a binary key, binaries
+// can include the prefix (:name, @name, $name) or omit it, returns 0 if not found
+static int
+param_index(ErlNifEnv *env, stmt_t *stmt, ERL_NIF_TERM key)
 {
-    assert(argc == 1);
+    ErlNifBinary bin;
+    char buf[256];
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
+    if (enif_is_atom(env, key))
+    {
+        for (unsigned int i = 0; i < stmt->name_count; i++)
+            if (stmt->names[i].atom && enif_is_identical(stmt->names[i].atom, key))
+                return stmt->names[i].idx;
 
-    int rc = sqlite3_step(stmt->stmt);
+        // the atom might have been created after the statement was prepared
+        int size = enif_get_atom(env, key, buf, sizeof(buf), ERL_NIF_LATIN1);
+        if (size <= 1)
+            return 0;
 
-    switch (rc)
-    {
-    case SQLITE_ROW:
+        bin.data = (unsigned char *)buf;
+        bin.size = size - 1;
+    }
+    else if (!enif_inspect_binary(env, key, &bin) || !bin.size)
     {
-        unsigned int column_count = sqlite3_column_count(stmt->stmt);
-        ERL_NIF_TERM row = make_row(env, column_count, stmt->stmt);
-        return enif_make_tuple2(env, am_row, row);
+        return 0;
     }
 
-    case SQLITE_DONE:
-        return am_done;
+    int prefixed = bin.data[0] == ':' || bin.data[0] == '@' || bin.data[0] == '$';
 
-    default:
-        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+    for (unsigned int i = 0; i < stmt->name_count; i++)
+    {
+        param_name_t *name = &stmt->names[i];
+
+        if (prefixed && name->size == bin.size && memcmp(name->name, bin.data, bin.size) == 0)
+            return name->idx;
+
+        if (!prefixed && name->size - 1 == bin.size && memcmp(name->name + 1, bin.data, bin.size) == 0)
+            return name->idx;
     }
+
+    return 0;
 }
 
+// binds a map of named params, values are inferred as in bind_term but
+// binaries are copied or pinned like in bind_text and bind_blob
 static ERL_NIF_TERM
-xqlite_multi_step(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_bind_map(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     assert(argc == 2);
 
     stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt) || !stmt->stmt)
         return enif_make_badarg(env);
 
-    unsigned int steps;
-    if (!enif_get_uint(env, argv[1], &steps))
+    ErlNifMapIterator iter;
+    if (!enif_map_iterator_create(env, argv[1], &iter, ERL_NIF_MAP_ITERATOR_FIRST))
         return enif_make_badarg(env);
 
-    unsigned int column_count = sqlite3_column_count(stmt->stmt);
+    int rc = SQLITE_OK;
+    ERL_NIF_TERM key, value;
 
-    ERL_NIF_TERM row;
-    ERL_NIF_TERM rows = enif_make_list_from_array(env, NULL, 0);
-    for (unsigned int step = 0; step < steps; step++)
+    sqlite3_mutex *mutex = stmt_mutex(stmt);
+    sqlite3_mutex_enter(mutex);
+
+    while (rc == SQLITE_OK && enif_map_iterator_get_pair(env, &iter, &key, &value))
     {
-        int rc = sqlite3_step(stmt->stmt);
-        switch (rc)
+        int idx = param_index(env, stmt, key);
+        if (!idx)
         {
-        case SQLITE_DONE:
-            return enif_make_tuple2(env, am_done, rows);
-
-        case SQLITE_ROW:
-            row = make_row(env, column_count, stmt->stmt);
-            rows = enif_make_list_cell(env, row, rows);
+            rc = XQLITE_BADARG;
             break;
+        }
 
-        default:
-            // TODO don't lose rc
-            sqlite3_reset(stmt->stmt);
-            return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+        ErlNifBinary bin;
+        const ERL_NIF_TERM *tuple;
+        int arity;
+
+        if (enif_inspect_binary(env, value, &bin))
+        {
+            rc = bind_pinned(stmt, idx, value, &bin, SQLITE_TEXT);
+        }
+        else if (enif_get_tuple(env, value, &arity, &tuple) && arity == 2 &&
+                 enif_is_identical(tuple[0], am_blob) && enif_inspect_binary(env, tuple[1], &bin))
+        {
+            rc = bind_pinned(stmt, idx, tuple[1], &bin, SQLITE_BLOB);
+        }
+        else
+        {
+            rc = bind_term(env, stmt->stmt, idx, value);
+            unpin(stmt, idx);
         }
-    }
 
-    return enif_make_tuple2(env, am_rows, rows);
-}
+        enif_map_iterator_next(env, &iter);
+    }
 
-static ERL_NIF_TERM
-xqlite_interrupt(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    assert(argc == 1);
+    sqlite3_mutex_leave(mutex);
+    enif_map_iterator_destroy(env, &iter);
 
-    db_t *db;
-    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+    if (rc == XQLITE_BADARG)
         return enif_make_badarg(env);
 
-    sqlite3_interrupt(db->db);
+    if (rc != SQLITE_OK)
+        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+
     return am_ok;
 }
 
-static ERL_NIF_TERM
-xqlite_finalize(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// binds the params of a {stmt, params} pair and fetches all of its rows into `result`,
+// returns SQLITE_DONE, XQLITE_BADARG, XQLITE_NOMEM or an error code
+static int
+run_batch_stmt(ErlNifEnv *env, sqlite3 *db, ERL_NIF_TERM pair, ERL_NIF_TERM *result)
 {
-    assert(argc == 1);
+    const ERL_NIF_TERM *tuple;
+    int arity;
+    if (!enif_get_tuple(env, pair, &arity, &tuple) || arity != 2)
+        return XQLITE_BADARG;
 
     stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
+    if (!enif_get_resource(env, tuple[0], stmt_type, (void **)&stmt) || !stmt->stmt)
+        return XQLITE_BADARG;
 
-    if (stmt->stmt)
+    if (sqlite3_db_handle(stmt->stmt) != db)
+        return XQLITE_BADARG;
+
+    int rc = bind_params(env, stmt->stmt, tuple[1]);
+
+    rows_t rows;
+    rows_init(&rows, stmt, enif_make_list_from_array(env, NULL, 0));
+
+    if (rc == SQLITE_OK)
+        rc = fetch_rows(env, stmt->stmt, &rows);
+
+    // text and blobs are bound with SQLITE_STATIC, see insert_rows
+    clear_bindings(stmt);
+
+    if (rc != SQLITE_DONE)
     {
-        sqlite3_finalize(stmt->stmt);
-        stmt->stmt = NULL;
+        rows_free(&rows);
+        return rc;
     }
 
-    return am_ok;
+    *result = rows_finish(env, &rows);
+    return SQLITE_DONE;
 }
 
+// runs a list of {stmt, params} pairs, optionally in a savepoint that is
+// rolled back if any of them fails, returns a list of rows for each statement
 static ERL_NIF_TERM
-xqlite_insert_all(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_run_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     assert(argc == 3);
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
         return enif_make_badarg(env);
 
-    int stmt_param_count = (unsigned int)sqlite3_bind_parameter_count(stmt->stmt);
-    int types_array[stmt_param_count];
+    unsigned int length;
+    if (!enif_get_list_length(env, argv[1], &length))
+        return enif_make_badarg(env);
 
-    ERL_NIF_TERM types = argv[1];
-    ERL_NIF_TERM rows = argv[2];
-    ERL_NIF_TERM head, tail;
+    int savepoint;
+    if (!enif_get_int(env, argv[2], &savepoint))
+        return enif_make_badarg(env);
 
-    // process types
-    for (unsigned int i = 0; i < stmt_param_count; i++)
+    int rc;
+    if (savepoint)
     {
-        if (!enif_get_list_cell(env, types, &head, &tail))
-            return enif_make_badarg(env);
-
-        int type;
-        if (!enif_get_int(env, head, &type))
-            return enif_make_badarg(env);
-
-        types_array[i] = type;
-        types = tail;
+        rc = sqlite3_exec(db->db, "SAVEPOINT xqlite_batch", NULL, NULL, NULL);
+        if (rc != SQLITE_OK)
+            return raise_sqlite3_error(env, rc, db->db);
     }
 
-    int rc;
+    // batches can be arbitrarily long, so results are consed and reversed
+    // at the end rather than staged in an array on the dirty scheduler's stack
+    ERL_NIF_TERM results = enif_make_list_from_array(env, NULL, 0);
+    ERL_NIF_TERM head, tail = argv[1];
+    rc = SQLITE_DONE;
 
-    // process rows
-    while (enif_get_list_cell(env, rows, &head, &tail))
+    for (unsigned int i = 0; i < length && rc == SQLITE_DONE; i++)
     {
-        // TODO dont lose rc
-        sqlite3_reset(stmt->stmt);
+        ERL_NIF_TERM result;
+        enif_get_list_cell(env, tail, &head, &tail);
+        rc = run_batch_stmt(env, db->db, head, &result);
 
-        // bind row
-        for (unsigned int i = 1; i <= stmt_param_count; i++)
-        {
-            ERL_NIF_TERM param;
+        if (rc == SQLITE_DONE)
+            results = enif_make_list_cell(env, result, results);
+    }
 
-            if (!enif_get_list_cell(env, head, &param, &head))
-                return enif_make_badarg(env);
+    if (rc == SQLITE_DONE && savepoint)
+    {
+        rc = sqlite3_exec(db->db, "RELEASE xqlite_batch", NULL, NULL, NULL);
+        if (rc == SQLITE_OK)
+            rc = SQLITE_DONE;
+    }
 
-            if (enif_is_identical(param, am_nil))
-            {
-                rc = sqlite3_bind_null(stmt->stmt, i);
-            }
-            else
-            {
-                switch (types_array[i - 1])
-                {
-                case SQLITE_INTEGER:
-                {
-                    int i32;
-                    ErlNifSInt64 i64;
-
-                    if (enif_get_int(env, param, &i32))
-                    {
-                        rc = sqlite3_bind_int(stmt->stmt, i, i32);
-                        break;
-                    }
-                    else if (enif_get_int64(env, param, &i64))
-                    {
-                        rc = sqlite3_bind_int64(stmt->stmt, i, i64);
-                        break;
-                    }
-                    else
-                    {
-                        return enif_make_badarg(env);
-                    }
-                }
-
-                case SQLITE_FLOAT:
-                {
-                    double f64;
-                    if (!enif_get_double(env, param, &f64))
-                        return enif_make_badarg(env);
-
-                    rc = sqlite3_bind_double(stmt->stmt, i, f64);
-                    break;
-                }
-
-                case SQLITE_TEXT:
-                {
-                    ErlNifBinary text;
-                    if (!enif_inspect_binary(env, param, &text))
-                        return enif_make_badarg(env);
-
-                    rc = sqlite3_bind_text(stmt->stmt, i, (char *)text.data, text.size, SQLITE_TRANSIENT);
-                    break;
-                }
-
-                case SQLITE_BLOB:
-                {
-                    ErlNifBinary blob;
-                    if (!enif_inspect_binary(env, param, &blob))
-                        return enif_make_badarg(env);
-
-                    rc = sqlite3_bind_blob(stmt->stmt, i, (char *)blob.data, blob.size, SQLITE_TRANSIENT);
-                    break;
-                }
-                }
-            }
+    if (rc == SQLITE_DONE)
+    {
+        enif_make_reverse_list(env, results, &results);
+        return results;
+    }
 
-            if (rc != SQLITE_OK)
-                return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
-        }
+    ERL_NIF_TERM error = 0;
+    if (rc != XQLITE_BADARG && rc != XQLITE_NOMEM)
+        error = make_sqlite3_error(env, rc, db->db);
 
-        rc = sqlite3_step(stmt->stmt);
-        if (rc != SQLITE_DONE)
-            return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+    if (savepoint)
+        sqlite3_exec(db->db, "ROLLBACK TO xqlite_batch; RELEASE xqlite_batch", NULL, NULL, NULL);
 
-        rows = tail;
-    }
+    if (rc == XQLITE_BADARG)
+        return enif_make_badarg(env);
+
+    if (rc == XQLITE_NOMEM)
+        return enif_raise_exception(env, am_out_of_memory);
 
-    return am_done;
+    return enif_raise_exception(env, error);
 }
 
+// binds params, steps and resets the statement in one call, returns the first row
+// or nil when `one` is set and the list of all rows otherwise
 static ERL_NIF_TERM
-xqlite_fetch_all(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_query(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    assert(argc == 1);
+    assert(argc == 3);
 
     stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt) || !stmt->stmt)
         return enif_make_badarg(env);
 
-    unsigned int column_count = sqlite3_column_count(stmt->stmt);
+    int one;
+    if (!enif_get_int(env, argv[2], &one))
+        return enif_make_badarg(env);
 
-    ERL_NIF_TERM row;
-    ERL_NIF_TERM rows = enif_make_list_from_array(env, NULL, 0);
+    progress_t progress;
+    progress_begin(stmt, &progress, 0);
 
-    while (1)
-    {
-        int rc = sqlite3_step(stmt->stmt);
-        switch (rc)
-        {
-        case SQLITE_DONE:
-            sqlite3_reset(stmt->stmt);
-            return rows;
+    int rc = bind_params(env, stmt->stmt, argv[1]);
+    ERL_NIF_TERM result = am_nil;
 
-        case SQLITE_ROW:
-            row = make_row(env, column_count, stmt->stmt);
-            rows = enif_make_list_cell(env, row, rows);
-            break;
+    if (rc == SQLITE_OK && one)
+    {
+        rc = sqlite3_step(stmt->stmt);
 
-        default:
-            sqlite3_reset(stmt->stmt);
-            return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+        if (rc == SQLITE_ROW)
+        {
+            result = make_row(env, sqlite3_column_count(stmt->stmt), stmt->stmt);
+            rc = SQLITE_DONE;
         }
     }
-}
+    else if (rc == SQLITE_OK)
+    {
+        rows_t rows;
+        rows_init(&rows, stmt, enif_make_list_from_array(env, NULL, 0));
+        rc = fetch_rows(env, stmt->stmt, &rows);
 
-static ERL_NIF_TERM
-xqlite_changes64(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    assert(argc == 1);
+        if (rc == SQLITE_DONE)
+            result = rows_finish(env, &rows);
+        else
+            rows_free(&rows);
+    }
 
-    db_t *db;
-    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
+    // build the error before reset and clear_bindings touch the connection
+    if (rc == SQLITE_INTERRUPT && progress.exceeded == XQLITE_PROGRESS_TIMEOUT)
+        result = am_timeout;
+    else if (rc != SQLITE_DONE && rc != XQLITE_BADARG && rc != XQLITE_NOMEM)
+        result = make_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+
+    // text and blobs are bound with SQLITE_STATIC, see insert_rows
+    sqlite3_reset(stmt->stmt);
+    clear_bindings(stmt);
+    progress_end(&progress);
+
+    switch (rc)
+    {
+    case SQLITE_DONE:
+        return result;
+
+    case XQLITE_BADARG:
         return enif_make_badarg(env);
 
-    sqlite_int64 changes = sqlite3_changes64(db->db);
-    return enif_make_int64(env, changes);
+    case XQLITE_NOMEM:
+        return enif_raise_exception(env, am_out_of_memory);
+
+    default:
+        return enif_raise_exception(env, result);
+    }
 }
 
 static ERL_NIF_TERM
-xqlite_total_changes64(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+make_worker_error(ErlNifEnv *env, ERL_NIF_TERM reason)
 {
-    assert(argc == 1);
-
-    db_t *db;
-    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
-        return enif_make_badarg(env);
-
-    sqlite_int64 total_changes = sqlite3_total_changes64(db->db);
-    return enif_make_int64(env, total_changes);
+    return enif_make_tuple2(env, am_error, reason);
 }
 
+// runs a command on the worker thread, returns {ok, result} or {error, reason}
 static ERL_NIF_TERM
-xqlite_clear_bindings(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+worker_run(worker_t *worker, command_t *cmd)
 {
-    assert(argc == 1);
+    ErlNifEnv *env = cmd->env;
+    ERL_NIF_TERM result;
+    int rc;
+
+    if (cmd->op == WORKER_EXEC)
+    {
+        ErlNifBinary sql;
+        if (!enif_inspect_binary(env, cmd->args[0], &sql))
+            return make_worker_error(env, am_badarg);
+
+        rc = sqlite3_exec(worker->db, (char *)sql.data, NULL, NULL, NULL);
+        if (rc != SQLITE_OK)
+            return make_worker_error(env, make_sqlite3_error(env, rc, worker->db));
+
+        return enif_make_tuple2(env, am_ok, am_ok);
+    }
 
     stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
+    if (!enif_get_resource(env, cmd->args[0], stmt_type, (void **)&stmt))
+        return make_worker_error(env, am_badarg);
 
-    int rc = sqlite3_clear_bindings(stmt->stmt);
-    if (rc != SQLITE_OK)
-        return raise_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt));
+    rows_t rows;
+    rows_init(&rows, stmt, enif_make_list_from_array(env, NULL, 0));
 
-    return am_ok;
-}
+    switch (cmd->op)
+    {
+    case WORKER_STEP:
+    {
+        unsigned int steps;
+        if (!enif_get_uint(env, cmd->args[1], &steps))
+            return make_worker_error(env, am_badarg);
 
-static ERL_NIF_TERM
-xqlite_enable_load_extension(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    assert(argc == 2);
+        rc = step_rows(env, stmt->stmt, steps, &rows);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+            break;
 
-    db_t *db;
-    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
-        return enif_make_badarg(env);
+        result = enif_make_tuple2(env, rc == SQLITE_ROW ? am_rows : am_done, rows_finish(env, &rows));
+        return enif_make_tuple2(env, am_ok, result);
+    }
 
-    int onoff;
-    if (!enif_get_int(env, argv[1], &onoff))
-        return enif_make_badarg(env);
+    case WORKER_FETCH_ALL:
+        rc = fetch_rows(env, stmt->stmt, &rows);
+        if (rc != SQLITE_DONE)
+            break;
 
-    int rc = sqlite3_enable_load_extension(db->db, onoff);
-    if (rc != SQLITE_OK)
-        return raise_sqlite3_error(env, rc, db->db);
+        return enif_make_tuple2(env, am_ok, rows_finish(env, &rows));
 
-    return am_ok;
-}
+    case WORKER_INSERT_ALL:
+    {
+        insert_progress_t progress = {0};
+        ERL_NIF_TERM rows = cmd->args[2];
+        rc = insert_rows(env, stmt, cmd->args[1], &rows, 1, &progress);
+        if (rc == XQLITE_BADARG)
+            return make_worker_error(env, am_badarg);
+        if (rc != SQLITE_DONE)
+            break;
 
-static ERL_NIF_TERM
-xqlite_sql(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    assert(argc == 1);
+        return enif_make_tuple2(env, am_ok, am_done);
+    }
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
+    default:
+        return make_worker_error(env, am_badarg);
+    }
 
-    const char *sql = sqlite3_sql(stmt->stmt);
-    return make_binary(env, (unsigned char *)sql, strlen(sql));
+    rows_free(&rows);
+    if (rc == XQLITE_NOMEM)
+        return make_worker_error(env, am_out_of_memory);
+
+    return make_worker_error(env, make_sqlite3_error(env, rc, sqlite3_db_handle(stmt->stmt)));
 }
 
-static ERL_NIF_TERM
-xqlite_expanded_sql(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+static void *
+worker_loop(void *arg)
 {
-    assert(argc == 1);
+    worker_t *worker = (worker_t *)arg;
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
+    while (1)
+    {
+        enif_mutex_lock(worker->lock);
+        while (!worker->head && !worker->shutdown)
+            enif_cond_wait(worker->cond, worker->lock);
 
-    const char *sql = sqlite3_expanded_sql(stmt->stmt);
-    ERL_NIF_TERM bin = make_binary(env, (unsigned char *)sql, strlen(sql));
-    sqlite3_free((void *)sql);
-    return bin;
-}
+        // shutting down and the queue is drained, exit with the lock held
+        command_t *cmd = worker->head;
+        if (!cmd)
+            break;
 
-static ERL_NIF_TERM
-xqlite_get_autocommit(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    assert(argc == 1);
+        worker->head = cmd->next;
+        if (!worker->head)
+            worker->tail = NULL;
+        enif_mutex_unlock(worker->lock);
 
-    db_t *db;
-    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
-        return enif_make_badarg(env);
+        ERL_NIF_TERM result = worker_run(worker, cmd);
+        ERL_NIF_TERM msg = enif_make_tuple2(cmd->env, cmd->ref, result);
+        enif_send(NULL, &cmd->caller, cmd->env, msg);
+        enif_free_env(cmd->env);
+        enif_free(cmd);
+    }
 
-    int autocommit = sqlite3_get_autocommit(db->db);
-    return enif_make_int(env, autocommit);
-}
+    int detached = worker->detached;
+    enif_mutex_unlock(worker->lock);
 
-static ERL_NIF_TERM
-xqlite_last_insert_rowid(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    assert(argc == 1);
+    if (detached)
+    {
+        sqlite3_close_v2(worker->db);
+        enif_cond_destroy(worker->cond);
+        enif_mutex_destroy(worker->lock);
+    }
 
-    db_t *db;
-    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
-        return enif_make_badarg(env);
+    xqlite_mem_flush();
 
-    sqlite3_int64 last_insert_rowid = sqlite3_last_insert_rowid(db->db);
-    return enif_make_int64(env, last_insert_rowid);
-}
+    if (detached)
+    {
+        enif_mutex_lock(exited_workers_lock);
+        worker->next = exited_workers;
+        exited_workers = worker;
+        detached_workers--;
+        enif_cond_broadcast(exited_workers_cond);
+        enif_mutex_unlock(exited_workers_lock);
+    }
 
-static ERL_NIF_TERM
-xqlite_memory_used(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    assert(argc == 0);
-    sqlite3_int64 memory_used = sqlite3_memory_used();
-    return enif_make_int64(env, memory_used);
+    return NULL;
 }
 
 static ERL_NIF_TERM
-xqlite_column_count(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+enqueue_command(ErlNifEnv *env, db_t *db, int op, int argc, const ERL_NIF_TERM args[])
 {
-    assert(argc == 1);
+    assert(argc <= 3);
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+    worker_t *worker = db->worker;
+    if (!worker)
         return enif_make_badarg(env);
 
-    int column_count = sqlite3_column_count(stmt->stmt);
-    return enif_make_int(env, column_count);
-}
+    command_t *cmd = enif_alloc(sizeof(command_t));
+    if (!cmd)
+        return enif_raise_exception(env, am_out_of_memory);
 
-static ERL_NIF_TERM
-xqlite_column_name(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
-{
-    assert(argc == 2);
+    cmd->env = enif_alloc_env();
+    if (!cmd->env)
+    {
+        enif_free(cmd);
+        return enif_raise_exception(env, am_out_of_memory);
+    }
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
+    ERL_NIF_TERM ref = enif_make_ref(env);
 
-    int idx;
-    if (!enif_get_int(env, argv[1], &idx))
+    cmd->next = NULL;
+    cmd->op = op;
+    cmd->ref = enif_make_copy(cmd->env, ref);
+    enif_self(env, &cmd->caller);
+
+    for (int i = 0; i < argc; i++)
+        cmd->args[i] = enif_make_copy(cmd->env, args[i]);
+
+    enif_mutex_lock(worker->lock);
+    if (worker->shutdown)
+    {
+        enif_mutex_unlock(worker->lock);
+        enif_free_env(cmd->env);
+        enif_free(cmd);
         return enif_make_badarg(env);
+    }
 
-    const char *name = sqlite3_column_name(stmt->stmt, idx);
-    if (!name)
-        return am_nil;
+    if (worker->tail)
+        worker->tail->next = cmd;
+    else
+        worker->head = cmd;
+    worker->tail = cmd;
 
-    return make_binary(env, (unsigned char *)name, strlen(name));
+    enif_cond_signal(worker->cond);
+    enif_mutex_unlock(worker->lock);
+
+    return ref;
 }
 
 static ERL_NIF_TERM
-xqlite_column_names(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_worker_exec(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    assert(argc == 1);
+    assert(argc == 2);
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+    db_t *db;
+    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
         return enif_make_badarg(env);
 
-    int column_count = sqlite3_column_count(stmt->stmt);
-    ERL_NIF_TERM columns[column_count];
-
-    for (unsigned int i = 0; i < column_count; i++)
-    {
-        const char *name = sqlite3_column_name(stmt->stmt, i);
-        if (!name)
-        {
-            columns[i] = am_nil;
-        }
-        else
-        {
-            columns[i] = make_binary(env, (unsigned char *)name, strlen(name));
-        }
-    }
+    if (!enif_is_binary(env, argv[1]))
+        return enif_make_badarg(env);
 
-    return enif_make_list_from_array(env, columns, column_count);
+    return enqueue_command(env, db, WORKER_EXEC, 1, argv + 1);
 }
 
-static ERL_NIF_TERM
-xqlite_bind_parameter_count(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// checks that the statement belongs to the connection the worker runs
+static int
+get_worker_stmt(ErlNifEnv *env, const ERL_NIF_TERM argv[], db_t **db)
 {
-    assert(argc == 1);
+    if (!enif_get_resource(env, argv[0], db_type, (void **)db))
+        return 0;
 
     stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
+    if (!enif_get_resource(env, argv[1], stmt_type, (void **)&stmt))
+        return 0;
 
-    int bind_parameter_count = sqlite3_bind_parameter_count(stmt->stmt);
-    return enif_make_int(env, bind_parameter_count);
+    return (*db)->db && sqlite3_db_handle(stmt->stmt) == (*db)->db;
 }
 
 static ERL_NIF_TERM
-xqlite_bind_parameter_index(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_worker_step(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    assert(argc == 2);
+    assert(argc == 3);
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
+    db_t *db;
+    if (!get_worker_stmt(env, argv, &db))
         return enif_make_badarg(env);
 
-    ErlNifBinary name;
-    if (!enif_inspect_binary(env, argv[1], &name))
+    unsigned int steps;
+    if (!enif_get_uint(env, argv[2], &steps))
         return enif_make_badarg(env);
 
-    int idx = sqlite3_bind_parameter_index(stmt->stmt, (char *)name.data);
-    return enif_make_int(env, idx);
+    return enqueue_command(env, db, WORKER_STEP, 2, argv + 1);
 }
 
 static ERL_NIF_TERM
-xqlite_bind_parameter_name(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_worker_fetch_all(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     assert(argc == 2);
 
-    stmt_t *stmt;
-    if (!enif_get_resource(env, argv[0], stmt_type, (void **)&stmt))
-        return enif_make_badarg(env);
-
-    int idx;
-    if (!enif_get_int(env, argv[1], &idx))
+    db_t *db;
+    if (!get_worker_stmt(env, argv, &db))
         return enif_make_badarg(env);
 
-    const char *name = sqlite3_bind_parameter_name(stmt->stmt, idx);
-    if (!name)
-        return am_nil;
-
-    return make_binary(env, (unsigned char *)name, strlen(name));
+    return enqueue_command(env, db, WORKER_FETCH_ALL, 1, argv + 1);
 }
 
 static ERL_NIF_TERM
-xqlite_exec(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+xqlite_worker_insert_all(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    assert(argc == 2);
+    assert(argc == 4);
 
     db_t *db;
-    if (!enif_get_resource(env, argv[0], db_type, (void **)&db))
-        return enif_make_badarg(env);
-
-    ErlNifBinary sql;
-    if (!enif_inspect_binary(env, argv[1], &sql))
+    if (!get_worker_stmt(env, argv, &db))
         return enif_make_badarg(env);
 
-    int rc = sqlite3_exec(db->db, (char *)sql.data, NULL, NULL, NULL);
-    if (rc != SQLITE_OK)
-        return raise_sqlite3_error(env, rc, db->db);
-
-    return am_ok;
+    return enqueue_command(env, db, WORKER_INSERT_ALL, 3, argv + 1);
 }
 
 static ErlNifFunc nif_funcs[] = {
-    {"dirty_io_open_nif", 2, xqlite_open, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"dirty_io_open_nif", 3, xqlite_open, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"dirty_io_close_nif", 1, xqlite_close, ERL_NIF_DIRTY_JOB_IO_BOUND},
 
     {"prepare_nif", 3, xqlite_prepare, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"prepare_cached", 2, xqlite_prepare_cached},
+    {"stmt_cache_stats", 1, xqlite_stmt_cache_stats},
+    {"set_stmt_cache_capacity", 2, xqlite_set_stmt_cache_capacity},
+    {"query_plan_nif", 1, xqlite_query_plan, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"set_plan_tracking", 2, xqlite_set_plan_tracking},
     {"finalize", 1, xqlite_finalize, ERL_NIF_DIRTY_JOB_CPU_BOUND},
     {"reset", 1, xqlite_reset, ERL_NIF_DIRTY_JOB_CPU_BOUND},
 
@@ -983,20 +5203,38 @@ static ErlNifFunc nif_funcs[] = {
     {"bind_integer", 3, xqlite_bind_integer},
     {"bind_float", 3, xqlite_bind_float},
     {"bind_null", 2, xqlite_bind_null},
+    {"bind_map", 2, xqlite_bind_map},
     {"clear_bindings", 1, xqlite_clear_bindings},
 
     {"step", 1, xqlite_step, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"unsafe_step", 1, xqlite_step},
+    {"adaptive_step_nif", 2, xqlite_adaptive_step},
     {"dirty_io_step_nif", 2, xqlite_multi_step, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"step_nif", 2, xqlite_multi_step},
     {"exec_nif", 2, xqlite_exec, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"set_telemetry_nif", 2, xqlite_set_telemetry},
+    {"drain_telemetry_nif", 2, xqlite_drain_telemetry},
+    {"set_slow_query_log_nif", 4, xqlite_set_slow_log},
+    {"dirty_io_slow_queries_nif", 1, xqlite_slow_queries, ERL_NIF_DIRTY_JOB_IO_BOUND},
 
     {"get_autocommit", 1, xqlite_get_autocommit},
 
     {"interrupt", 1, xqlite_interrupt},
+    {"set_timeout_nif", 2, xqlite_set_timeout},
 
     {"dirty_io_fetch_all_nif", 1, xqlite_fetch_all, ERL_NIF_DIRTY_JOB_IO_BOUND},
-    {"dirty_io_insert_all_nif", 3, xqlite_insert_all, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"yielding_fetch_all_nif", 1, xqlite_yielding_fetch_all},
+    {"dirty_io_fetch_columns_nif", 2, xqlite_fetch_columns, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"dirty_io_insert_all_nif", 5, xqlite_insert_all, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"dirty_io_insert_columns_nif", 3, xqlite_insert_columns, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"bind_plan_nif", 2, xqlite_bind_plan},
+    {"dirty_io_run_batch_nif", 3, xqlite_run_batch, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"dirty_io_query_nif", 3, xqlite_query, ERL_NIF_DIRTY_JOB_IO_BOUND},
+
+    {"worker_exec_nif", 2, xqlite_worker_exec},
+    {"worker_step_nif", 3, xqlite_worker_step},
+    {"worker_fetch_all_nif", 2, xqlite_worker_fetch_all},
+    {"worker_insert_all_nif", 4, xqlite_worker_insert_all},
 
     {"column_count", 1, xqlite_column_count},
     {"column_name", 2, xqlite_column_name},
@@ -1010,8 +5248,12 @@ static ErlNifFunc nif_funcs[] = {
 
     {"sql", 1, xqlite_sql},
     {"expanded_sql", 1, xqlite_expanded_sql},
+    {"stmt_status_nif", 2, xqlite_stmt_status},
+    {"scan_status_nif", 2, xqlite_scan_status},
 
     {"memory_used", 0, xqlite_memory_used},
+    {"status_nif", 1, xqlite_status},
+    {"db_status_nif", 2, xqlite_db_status},
 };
 
 ERL_NIF_INIT(Elixir.XQLite, nif_funcs, on_load, NULL, NULL, on_unload)
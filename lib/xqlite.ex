@@ -5,6 +5,8 @@ defmodule XQLite do
   @type stmt :: reference
   @type value :: binary | number | nil
   @type row :: [value]
+  @type bind_type :: :integer | :float | :text | :blob
+  @type bind_plan :: reference
 
   @compile {:autoload, false}
   @on_load {:load_nif, 0}
@@ -43,7 +45,7 @@ defmodule XQLite do
 
   open_flag_names = Enum.map(open_flags, fn {name, _value} -> name end)
   open_flag_union = Enum.reduce(open_flag_names, &{:|, [], [&1, &2]})
-  @type open_flag :: unquote(open_flag_union)
+  @type open_flag :: unquote(open_flag_union) | :worker
 
   for {name, value} <- open_flags do
     defp open_flag(unquote(name)), do: unquote(value)
@@ -67,13 +69,25 @@ defmodule XQLite do
       iex> _reader = XQLite.open("test.db", [:readonly, :exrescode])
       iex> _memory = XQLite.open(":memory:", [:readwrite])
 
+  The `:worker` flag starts a dedicated OS thread for the connection
+  which executes the `async_*` functions, see `async_exec/2`.
+
+      iex> _worker = XQLite.open(":memory:", [:readwrite, :worker])
+
   """
   @spec open(Path.t(), [open_flag]) :: db
   def open(path, flags) do
-    dirty_io_open_nif(path <> <<0>>, bor_open_flags(flags, 0))
+    case :lists.member(:worker, flags) do
+      true ->
+        flags = :lists.filter(fn flag -> flag != :worker end, flags)
+        dirty_io_open_nif(path <> <<0>>, bor_open_flags(flags, 0), 1)
+
+      false ->
+        dirty_io_open_nif(path <> <<0>>, bor_open_flags(flags, 0), 0)
+    end
   end
 
-  defp dirty_io_open_nif(_path, _flags), do: :erlang.nif_error(:undef)
+  defp dirty_io_open_nif(_path, _flags, _worker), do: :erlang.nif_error(:undef)
 
   @doc """
   Closes a database using [sqlite3_close_v2()](https://www.sqlite.org/c3ref/close.html)
@@ -92,7 +106,8 @@ defmodule XQLite do
   @spec prepare(db, binary) :: stmt
   def prepare(db, sql), do: prepare_nif(db, sql, 0)
 
-  prepare_flags = [persistent: 0x01, normalize: 0x02, no_vtab: 0x04]
+  # :sub_binaries is xqlite specific and is stripped before sqlite3_prepare_v3
+  prepare_flags = [persistent: 0x01, normalize: 0x02, no_vtab: 0x04, sub_binaries: 0x100000]
   prepare_flag_names = Enum.map(prepare_flags, fn {name, _value} -> name end)
   prepare_flag_union = Enum.reduce(prepare_flag_names, &{:|, [], [&1, &2]})
   @type prepare_flag :: unquote(prepare_flag_union)
@@ -118,12 +133,91 @@ defmodule XQLite do
       iex> db = XQLite.open(":memory:", [:readonly])
       iex> XQLite.prepare(db, "SELECT ?", [:persistent])
 
+  With the `:sub_binaries` flag, `step/2`, `fetch_all/1` and `yielding_fetch_all/1`
+  copy all text and blob cells of a batch into one binary and return them as
+  sub binaries of it. This replaces a binary allocation per cell with one per batch,
+  but keeping any single cell alive keeps the whole batch's binary alive,
+  so use `:binary.copy/1` on values that are retained long term.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "SELECT 'a', x'62'", [:sub_binaries])
+      iex> XQLite.fetch_all(stmt)
+      [["a", "b"]]
+
   """
   @spec prepare(db, binary, [prepare_flag]) :: stmt
   def prepare(db, sql, flags), do: prepare_nif(db, sql, bor_prepare_flags(flags, 0))
 
   defp prepare_nif(_db, _sql, _flags), do: :erlang.nif_error(:undef)
 
+  @doc """
+  Returns a prepared statement from the connection's LRU statement cache,
+  preparing it with the `:persistent` flag on a miss.
+
+  Cached statements are reset and have their bindings cleared on every hit.
+  The same statement is returned to every caller asking for the same SQL,
+  so it must not be used from several processes at once.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare_cached(db, "SELECT ?")
+      iex> ^stmt = XQLite.prepare_cached(db, "SELECT ?")
+      iex> XQLite.stmt_cache_stats(db)
+      %{hits: 1, misses: 1, evictions: 0, size: 1, capacity: 64}
+
+  """
+  @spec prepare_cached(db, binary) :: stmt
+  def prepare_cached(_db, _sql), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Returns statement cache counters, see `prepare_cached/2`.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> XQLite.stmt_cache_stats(db)
+      %{hits: 0, misses: 0, evictions: 0, size: 0, capacity: 64}
+
+  """
+  @spec stmt_cache_stats(db) :: %{
+          hits: non_neg_integer,
+          misses: non_neg_integer,
+          evictions: non_neg_integer,
+          size: non_neg_integer,
+          capacity: non_neg_integer
+        }
+  def stmt_cache_stats(_db), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Sets the maximum number of statements kept by `prepare_cached/2`,
+  evicting the least recently used ones if needed. Zero disables caching.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> XQLite.prepare_cached(db, "SELECT 1")
+      iex> XQLite.set_stmt_cache_capacity(db, 0)
+      iex> XQLite.stmt_cache_stats(db)
+      %{hits: 0, misses: 1, evictions: 1, size: 0, capacity: 0}
+
+  """
+  @spec set_stmt_cache_capacity(db, non_neg_integer) :: :ok
+  def set_stmt_cache_capacity(_db, _capacity), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Reports plan changes of statements cached by `prepare_cached/2` to `pid`.
+
+  While tracking is on, each cached statement keeps a fingerprint of its
+  `EXPLAIN QUERY PLAN` output. When `prepare_cached/2` returns a statement that
+  has been reprepared since (after a schema change or `ANALYZE`), the plan is
+  explained again and `{:xqlite_plan_changed, sql, rows}` is sent to `pid` if the
+  fingerprint differs, where `rows` can be turned into a tree with `plan_tree/1`.
+  Statements cached before tracking was turned on are fingerprinted at their first
+  reprepare. Pass `nil` to stop tracking.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> XQLite.set_plan_tracking(db, self())
+      :ok
+
+  """
+  @spec set_plan_tracking(db, pid | nil) :: :ok
+  def set_plan_tracking(_db, _pid), do: :erlang.nif_error(:undef)
+
   @doc """
   Returns number of SQL parameters in a prepared statement.
 
@@ -229,6 +323,24 @@ defmodule XQLite do
   @spec bind_null(stmt, non_neg_integer) :: :ok
   def bind_null(_stmt, _index), do: :erlang.nif_error(:undef)
 
+  @doc """
+  Binds named parameters from a map in a single call.
+
+  Keys are atoms or binaries, with or without the `:`, `@` or `$` prefix.
+  The names are resolved through a table built when the statement is prepared,
+  values are inferred the same way as in `run_batch/3`. Unknown keys raise.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "SELECT :name, @age, $admin")
+      iex> XQLite.bind_map(stmt, %{name: "Alice", "@age" => 42, "admin" => true})
+      :ok
+      iex> XQLite.step(stmt)
+      {:row, ["Alice", 42, 1]}
+
+  """
+  @spec bind_map(stmt, %{optional(atom | String.t()) => term}) :: :ok
+  def bind_map(_stmt, _params), do: :erlang.nif_error(:undef)
+
   @doc """
   Resets a prepared statement using [sqlite3_reset()](https://www.sqlite.org/c3ref/reset.html)
 
@@ -273,6 +385,29 @@ defmodule XQLite do
   @spec unsafe_step(stmt) :: {:row, row} | :done
   def unsafe_step(_stmt), do: :erlang.nif_error(:undef)
 
+  @doc """
+  Same as `step/1` but starts on a regular scheduler.
+
+  If the statement runs more than `budget` VM instructions, it is reset and the
+  step is transparently retried on a dirty IO scheduler. Only read-only statements
+  that haven't been stepped yet start on a regular scheduler since only they can be
+  restarted safely, others always go to a dirty IO scheduler. So does a step that
+  finds the connection busy with another call, instead of waiting for it.
+
+  This makes point queries served from the page cache skip the dirty scheduler hop
+  while keeping long running queries off the regular schedulers.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "SELECT 1")
+      iex> XQLite.adaptive_step(stmt)
+      {:row, [1]}
+
+  """
+  @spec adaptive_step(stmt, pos_integer) :: {:row, row} | :done
+  def adaptive_step(stmt, budget \\ 1000), do: adaptive_step_nif(stmt, budget)
+
+  defp adaptive_step_nif(_stmt, _budget), do: :erlang.nif_error(:undef)
+
   @doc """
   Executes a prepared statement `count` times.
 
@@ -283,21 +418,13 @@ defmodule XQLite do
 
   """
   @spec step(stmt, non_neg_integer) :: {:rows | :done, [row]}
-  def step(stmt, count) do
-    with {tag, rows} <- dirty_io_step_nif(stmt, count) do
-      {tag, :lists.reverse(rows)}
-    end
-  end
+  def step(stmt, count), do: dirty_io_step_nif(stmt, count)
 
   defp dirty_io_step_nif(_stmt, _count), do: :erlang.nif_error(:undef)
 
   @doc "Same as `step/2` but runs on a regular scheduler."
   @spec unsafe_step(stmt, non_neg_integer) :: {:rows | :done, [row]}
-  def unsafe_step(stmt, count) do
-    with {tag, rows} <- step_nif(stmt, count) do
-      {tag, :lists.reverse(rows)}
-    end
-  end
+  def unsafe_step(stmt, count), do: step_nif(stmt, count)
 
   defp step_nif(_stmt, _count), do: :erlang.nif_error(:undef)
 
@@ -323,6 +450,38 @@ defmodule XQLite do
   @spec interrupt(db) :: :ok
   def interrupt(_db), do: :erlang.nif_error(:undef)
 
+  @doc """
+  Limits how long a single call can run a prepared statement.
+
+  The deadline is checked from a progress handler every 1000 VM instructions,
+  so no extra process is needed to enforce it. A call that runs past its deadline is
+  interrupted, the statement is reset and `:timeout` is raised. As with `interrupt/1`,
+  an interrupted write is rolled back.
+
+  The timeout applies to `step/1`, `step/2`, `fetch_all/1`, `fetch_columns/2`,
+  `query_one/2`, `query_all/2` and `adaptive_step/2`. Pass `:infinity` to remove it,
+  timeouts longer than about 146 years are treated the same way.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> cte = \"""
+      ...> with recursive c(x) as (
+      ...>   values(1) union all
+      ...>   select x+1 from c where x < 10000000000000
+      ...> ) select sum(x) from c
+      ...> \"""
+      iex> stmt = XQLite.prepare(db, cte)
+      iex> XQLite.set_timeout(stmt, 10)
+      :ok
+      iex> XQLite.step(stmt)
+      ** (ErlangError) Erlang error: :timeout
+
+  """
+  @spec set_timeout(stmt, non_neg_integer | :infinity) :: :ok
+  def set_timeout(stmt, :infinity), do: set_timeout_nif(stmt, 0)
+  def set_timeout(stmt, timeout) when is_integer(timeout), do: set_timeout_nif(stmt, timeout)
+
+  defp set_timeout_nif(_stmt, _timeout), do: :erlang.nif_error(:undef)
+
   @doc """
   Returns all rows from a prepared statement.
 
@@ -333,12 +492,142 @@ defmodule XQLite do
 
   """
   @spec fetch_all(stmt) :: [row]
-  def fetch_all(stmt) do
-    :lists.reverse(dirty_io_fetch_all_nif(stmt))
-  end
+  def fetch_all(stmt), do: dirty_io_fetch_all_nif(stmt)
 
   defp dirty_io_fetch_all_nif(_stmt), do: :erlang.nif_error(:undef)
 
+  @doc """
+  Binds `params`, returns the first row (or `nil`) and resets the statement in one call.
+
+  Param types are inferred the same way as in `run_batch/3`.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "SELECT ? + 1 WHERE ? IS NOT NULL")
+      iex> XQLite.query_one(stmt, [41, true])
+      [42]
+      iex> XQLite.query_one(stmt, [41, nil])
+      nil
+
+  """
+  @spec query_one(stmt, [term]) :: row | nil
+  def query_one(stmt, params), do: dirty_io_query_nif(stmt, params, 1)
+
+  @doc """
+  Binds `params`, returns all rows and resets the statement in one call.
+
+  Param types are inferred the same way as in `run_batch/3`.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "SELECT value FROM json_each(?) WHERE value > ?")
+      iex> XQLite.query_all(stmt, ["[1, 2, 3]", 1])
+      [[2], [3]]
+
+  """
+  @spec query_all(stmt, [term]) :: [row]
+  def query_all(stmt, params), do: dirty_io_query_nif(stmt, params, 0)
+
+  defp dirty_io_query_nif(_stmt, _params, _one), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Same as `fetch_all/1` but runs on a regular scheduler.
+
+  Rows are stepped in small batches and the NIF yields back to the scheduler
+  once its timeslice is used up, so long scans don't occupy a dirty IO thread
+  and cheap queries avoid the dirty scheduler hop.
+
+  Work that can't be split that way is moved to a dirty IO scheduler: a single
+  step running more than 100000 VM instructions (e.g. sorting or aggregating a
+  large table before the first row) makes the query start over there, and finding
+  the connection busy with another call continues there instead of waiting.
+  Statements that are not read-only or have already been stepped can't be
+  restarted, so they run on a dirty IO scheduler from the start. Waits in a busy
+  handler (`PRAGMA busy_timeout`) aren't bounded, prefer `fetch_all/1` on
+  connections that might wait for file locks. The timeout set with `set_timeout/2`
+  applies to the whole call.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "SELECT 1")
+      iex> XQLite.yielding_fetch_all(stmt)
+      [[1]]
+
+  """
+  @spec yielding_fetch_all(stmt) :: [row]
+  def yielding_fetch_all(stmt) do
+    :lists.reverse(yielding_fetch_all_nif(stmt))
+  end
+
+  defp yielding_fetch_all_nif(_stmt), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Returns all rows from a prepared statement column by column, along with column names.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "SELECT 1 AS a, 'x' AS b UNION ALL SELECT 2, NULL")
+      iex> XQLite.fetch_columns(stmt)
+      {["a", "b"], [[1, 2], ["x", nil]]}
+
+  With `packed: true`, columns holding only integers or only floats are returned as
+  binaries of native-endian 64 bit values, ready for `Nx.from_binary/2` and similar.
+  Columns with mixed types or NULLs fall back to lists, and so do all columns
+  when there are no rows.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "SELECT 1, 0.5, 'x' UNION ALL SELECT 2, 1.5, 'y'")
+      iex> {_names, [ints, floats, texts]} = XQLite.fetch_columns(stmt, packed: true)
+      iex> ints
+      <<1::64-signed-native, 2::64-signed-native>>
+      iex> floats
+      <<0.5::64-float-native, 1.5::64-float-native>>
+      iex> texts
+      ["x", "y"]
+
+  """
+  @spec fetch_columns(stmt, [{:packed, boolean}]) :: {[String.t()], [list | binary]}
+  def fetch_columns(stmt, opts \\ []) do
+    packed = if Keyword.get(opts, :packed, false), do: 1, else: 0
+    dirty_io_fetch_columns_nif(stmt, packed)
+  end
+
+  defp dirty_io_fetch_columns_nif(_stmt, _packed), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Returns a lazy stream of row chunks from a prepared statement.
+
+  Each element is a list of up to `:chunk_size` rows (defaults to 500) fetched
+  with `step/2`, so only one chunk is held in memory at a time and rows are only
+  read as fast as the stream is consumed. The statement is reset when the stream
+  is done, halted early, or raises.
+
+  An `interrupt/1` issued between chunks takes effect on the next chunk,
+  which then raises like `step/2` would.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "SELECT 1 UNION ALL SELECT 2 UNION ALL SELECT 3")
+      iex> stmt |> XQLite.stream(chunk_size: 2) |> Enum.to_list()
+      [[[1], [2]], [[3]]]
+
+  """
+  @spec stream(stmt, [{:chunk_size, pos_integer}]) :: Enumerable.t([row])
+  def stream(stmt, opts \\ []) do
+    chunk_size = Keyword.get(opts, :chunk_size, 500)
+
+    Stream.resource(
+      fn -> :rows end,
+      fn
+        :rows ->
+          case step(stmt, chunk_size) do
+            {:rows, rows} -> {[rows], :rows}
+            {:done, []} -> {:halt, :done}
+            {:done, rows} -> {[rows], :done}
+          end
+
+        :done ->
+          {:halt, :done}
+      end,
+      fn _state -> reset(stmt) end
+    )
+  end
+
   @doc """
   Bulk-inserts rows into a prepared statement. Must be called inside a transaction.
 
@@ -358,11 +647,126 @@ defmodule XQLite do
       ...> end
 
   """
-  @spec insert_all(stmt, [:integer | :float | :text | :blob], [row]) :: :done
+  @spec insert_all(stmt, [bind_type] | bind_plan, [row]) :: :done
   def insert_all(stmt, types, rows) do
-    dirty_io_insert_all_nif(stmt, process_types(types), rows)
+    _inserted = insert_all(stmt, types, rows, [])
+    :done
   end
 
+  @doc """
+  Same as `insert_all/3` but accepts options and returns the number of processed rows.
+
+    * `:batch` - inserts this many rows per step with a rewritten multi-row
+      `INSERT ... VALUES (?, ?), (?, ?), ...` statement, the rest is inserted
+      one by one. The rewritten statement is cached on `stmt` for the last used
+      batch size. Only statements ending in a single tuple of anonymous `?`
+      parameters are rewritten, others are always executed row by row.
+      Defaults to `1`.
+
+      A batch is a single statement, so a failing row undoes the whole batch. When
+      a row fails, the earlier batches stay inserted. Its own batch is not inserted,
+      including the rows before it, and neither are the rows after it. `ON CONFLICT`
+      clauses still apply to each row.
+
+    * `:transaction` - when `true`, rows are inserted in `BEGIN IMMEDIATE` transactions
+      started and committed by `insert_all/4` itself, so it must not be called inside
+      another transaction. On error the current transaction is rolled back and
+      the error is raised. Defaults to `false`.
+
+    * `:commit_every` - with `transaction: true`, commits after this many rows and
+      continues in a new transaction. The NIF is rescheduled between commits,
+      so long loads don't hold a dirty IO scheduler or grow the WAL unboundedly.
+      Rows of already committed transactions stay inserted when a later one fails.
+
+    * `:commit_bytes` - same as `:commit_every` but commits once the bound text
+      and blobs (plus 8 bytes per other value) add up to this many bytes.
+
+      iex> db = XQLite.open(":memory:", [:readwrite])
+      iex> XQLite.exec(db, "CREATE TABLE users (name TEXT)")
+      iex> insert = XQLite.prepare(db, "INSERT INTO users (name) VALUES (?)")
+      iex> rows = [["Alice"], ["Bob"], ["Eve"]]
+      iex> XQLite.insert_all(insert, [:text], rows, batch: 2, transaction: true, commit_every: 2)
+      3
+      iex> XQLite.fetch_all(XQLite.prepare(db, "SELECT name FROM users"))
+      [["Alice"], ["Bob"], ["Eve"]]
+
+  """
+  @type insert_all_opt ::
+          {:batch, pos_integer}
+          | {:transaction, boolean}
+          | {:commit_every, pos_integer}
+          | {:commit_bytes, pos_integer}
+
+  @spec insert_all(stmt, [bind_type] | bind_plan, [row], [insert_all_opt]) :: non_neg_integer
+  def insert_all(stmt, types, rows, opts) do
+    batch = Keyword.get(opts, :batch, 1)
+    transaction = if Keyword.get(opts, :transaction, false), do: 1, else: 0
+    commit_every = Keyword.get(opts, :commit_every, 0)
+    commit_bytes = Keyword.get(opts, :commit_bytes, 0)
+
+    if transaction == 0 and (commit_every > 0 or commit_bytes > 0) do
+      raise ArgumentError, ":commit_every and :commit_bytes require transaction: true"
+    end
+
+    opts = {batch, transaction, commit_every, commit_bytes}
+    dirty_io_insert_all_nif(stmt, bind_types(types), rows, opts, 0)
+  end
+
+  @doc """
+  Bulk-inserts column-wise data into a prepared statement. Must be called inside a transaction.
+
+  Takes one column per statement parameter, all of the same length. A column is a list
+  of values of its type (or `nil`), and `:integer` and `:float` columns can also be
+  binaries of native-endian 64 bit integers or doubles, which are bound directly.
+
+      iex> db = XQLite.open(":memory:", [:readwrite])
+      iex> XQLite.exec(db, "CREATE TABLE points (id INTEGER, x REAL, label TEXT)")
+      iex> insert = XQLite.prepare(db, "INSERT INTO points (id, x, label) VALUES (?, ?, ?)")
+      iex> ids = <<1::64-signed-native, 2::64-signed-native>>
+      iex> xs = <<0.5::64-float-native, 1.5::64-float-native>>
+      iex> XQLite.insert_columns(insert, [:integer, :float, :text], [ids, xs, ["a", nil]])
+      :done
+      iex> XQLite.fetch_all(XQLite.prepare(db, "SELECT * FROM points"))
+      [[1, 0.5, "a"], [2, 1.5, nil]]
+
+  """
+  @spec insert_columns(stmt, [bind_type] | bind_plan, [list | binary]) :: :done
+  def insert_columns(stmt, types, columns) do
+    dirty_io_insert_columns_nif(stmt, bind_types(types), columns)
+  end
+
+  defp dirty_io_insert_columns_nif(_stmt, _types, _columns), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Creates a bind plan for `insert_all/4`, `insert_columns/3` and `async_insert_all/4`
+  from a type for each of the statement's parameters.
+
+  The types are validated against the statement once, instead of being
+  processed on each insert, and the plan can be reused with any statement
+  with the same number of parameters.
+
+      iex> db = XQLite.open(":memory:", [:readwrite])
+      iex> XQLite.exec(db, "CREATE TABLE users (id INTEGER, name TEXT)")
+      iex> insert = XQLite.prepare(db, "INSERT INTO users (id, name) VALUES (?, ?)")
+      iex> plan = XQLite.bind_plan(insert, [:integer, :text])
+      iex> XQLite.insert_all(insert, plan, [[1, "Alice"], [2, "Bob"]])
+      :done
+
+  Raises `ArgumentError` if the number of types doesn't match the number of parameters.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> XQLite.bind_plan(XQLite.prepare(db, "SELECT ?, ?"), [:integer])
+      ** (ArgumentError) argument error
+
+  """
+  @spec bind_plan(stmt, [bind_type]) :: bind_plan
+  def bind_plan(stmt, types), do: bind_plan_nif(stmt, process_types(types))
+
+  defp bind_plan_nif(_stmt, _types), do: :erlang.nif_error(:undef)
+
+  defp bind_types(plan) when is_reference(plan), do: plan
+  defp bind_types(types) when is_list(types), do: process_types(types)
+
   defp process_types([type | types]) do
     [process_type(type) | process_types(types)]
   end
@@ -374,7 +778,95 @@ defmodule XQLite do
   defp process_type(:text), do: 3
   defp process_type(:blob), do: 4
 
-  defp dirty_io_insert_all_nif(_stmt, _types, _rows), do: :erlang.nif_error(:undef)
+  defp dirty_io_insert_all_nif(_stmt, _types, _rows, _opts, _inserted) do
+    :erlang.nif_error(:undef)
+  end
+
+  @doc """
+  Executes an SQL statement on the connection's worker thread.
+
+  The database must be opened with the `:worker` flag. Returns a reference
+  right away, the result is later delivered to the caller as
+  `{ref, {:ok, result}}` or `{ref, {:error, reason}}` message,
+  which can be awaited with `await/2`.
+
+  Commands are executed in the order they were submitted, so a connection
+  can be used by many processes at once without occupying dirty schedulers.
+
+      iex> db = XQLite.open(":memory:", [:readwrite, :worker])
+      iex> ref = XQLite.async_exec(db, "CREATE TABLE users (name TEXT)")
+      iex> XQLite.await(ref)
+      :ok
+
+  """
+  @spec async_exec(db, String.t()) :: reference
+  def async_exec(db, sql), do: worker_exec_nif(db, sql <> <<0>>)
+
+  defp worker_exec_nif(_db, _sql), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Same as `step/2` but executed on the connection's worker thread, see `async_exec/2`.
+
+      iex> db = XQLite.open(":memory:", [:readonly, :worker])
+      iex> stmt = XQLite.prepare(db, "SELECT 1")
+      iex> XQLite.await(XQLite.async_step(db, stmt, 2))
+      {:done, [[1]]}
+
+  """
+  @spec async_step(db, stmt, non_neg_integer) :: reference
+  def async_step(db, stmt, count), do: worker_step_nif(db, stmt, count)
+
+  defp worker_step_nif(_db, _stmt, _count), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Same as `fetch_all/1` but executed on the connection's worker thread, see `async_exec/2`.
+
+      iex> db = XQLite.open(":memory:", [:readonly, :worker])
+      iex> stmt = XQLite.prepare(db, "SELECT 1")
+      iex> XQLite.await(XQLite.async_fetch_all(db, stmt))
+      [[1]]
+
+  """
+  @spec async_fetch_all(db, stmt) :: reference
+  def async_fetch_all(db, stmt), do: worker_fetch_all_nif(db, stmt)
+
+  defp worker_fetch_all_nif(_db, _stmt), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Same as `insert_all/3` but executed on the connection's worker thread, see `async_exec/2`.
+
+      iex> db = XQLite.open(":memory:", [:readwrite, :worker])
+      iex> XQLite.exec(db, "CREATE TABLE users (name TEXT)")
+      iex> insert = XQLite.prepare(db, "INSERT INTO users (name) VALUES (?)")
+      iex> XQLite.await(XQLite.async_insert_all(db, insert, [:text], [["Alice"], ["Bob"]]))
+      :done
+
+  """
+  @spec async_insert_all(db, stmt, [bind_type] | bind_plan, [row]) :: reference
+  def async_insert_all(db, stmt, types, rows) do
+    worker_insert_all_nif(db, stmt, bind_types(types), rows)
+  end
+
+  defp worker_insert_all_nif(_db, _stmt, _types, _rows), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Waits for the result of an `async_*` call, raising on errors like the synchronous functions do.
+
+      iex> db = XQLite.open(":memory:", [:readonly, :worker])
+      iex> ref = XQLite.async_exec(db, "CREATE TABLE users (name TEXT)")
+      iex> XQLite.await(ref)
+      ** (ErlangError) Erlang error: {:xqlite, 8, ~c"attempt to write a readonly database"}
+
+  """
+  @spec await(reference, timeout) :: term
+  def await(ref, timeout \\ :infinity) do
+    receive do
+      {^ref, {:ok, result}} -> result
+      {^ref, {:error, reason}} -> :erlang.error(reason)
+    after
+      timeout -> exit({:timeout, {__MODULE__, :await, [ref, timeout]}})
+    end
+  end
 
   @doc """
   Returns the number of rows changed by the most recent statement.
@@ -462,6 +954,121 @@ defmodule XQLite do
   @spec expanded_sql(stmt) :: String.t()
   def expanded_sql(_stmt), do: :erlang.nif_error(:undef)
 
+  @typedoc "See `query_plan/1`."
+  @type plan_node :: %{id: integer, detail: String.t(), children: [plan_node]}
+
+  @doc """
+  Returns the [EXPLAIN QUERY PLAN](https://www.sqlite.org/eqp.html) tree of a prepared statement.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "select * from sqlite_master where name = ?")
+      iex> [%{detail: "SCAN sqlite_master", children: []}] = XQLite.query_plan(stmt)
+
+  """
+  @spec query_plan(stmt) :: [plan_node]
+  def query_plan(stmt), do: stmt |> query_plan_nif() |> plan_tree()
+
+  defp query_plan_nif(_stmt), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Builds a tree out of `EXPLAIN QUERY PLAN` rows given as `{id, parent, detail}` tuples.
+
+      iex> XQLite.plan_tree([{2, 0, "SCAN a"}, {5, 0, "SCAN b"}, {7, 5, "USE TEMP B-TREE"}])
+      [
+        %{id: 2, detail: "SCAN a", children: []},
+        %{id: 5, detail: "SCAN b", children: [%{id: 7, detail: "USE TEMP B-TREE", children: []}]}
+      ]
+
+  """
+  @spec plan_tree([{integer, integer, String.t()}]) :: [plan_node]
+  def plan_tree(rows) do
+    rows
+    |> Enum.group_by(fn {_id, parent, _detail} -> parent end)
+    |> build_plan_tree(0)
+  end
+
+  defp build_plan_tree(children, parent) do
+    children
+    |> Map.get(parent, [])
+    |> Enum.map(fn {id, _parent, detail} ->
+      %{id: id, detail: detail, children: build_plan_tree(children, id)}
+    end)
+  end
+
+  @typedoc "See `stmt_status/2`."
+  @type stmt_status :: %{
+          fullscan_step: non_neg_integer,
+          sort: non_neg_integer,
+          autoindex: non_neg_integer,
+          vm_step: non_neg_integer,
+          reprepare: non_neg_integer,
+          run: non_neg_integer,
+          filter_miss: non_neg_integer,
+          filter_hit: non_neg_integer,
+          memused: non_neg_integer
+        }
+
+  @doc """
+  Returns the runtime counters of a prepared statement using
+  [sqlite3_stmt_status()](https://www.sqlite.org/c3ref/stmt_status.html).
+
+  High `fullscan_step`, `sort` and `autoindex` counts point at statements missing an index.
+  With `reset: true` the counters (except `memused`) are zeroed after being read.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "select value from json_each('[3, 1, 2]') order by value")
+      iex> XQLite.fetch_all(stmt)
+      [[1], [2], [3]]
+      iex> %{sort: 1, run: 1} = XQLite.stmt_status(stmt, reset: true)
+      iex> %{sort: 0, run: 0} = XQLite.stmt_status(stmt)
+
+  """
+  @spec stmt_status(stmt, [{:reset, boolean}]) :: stmt_status
+  def stmt_status(stmt, opts \\ []) do
+    reset = if Keyword.get(opts, :reset, false), do: 1, else: 0
+    stmt_status_nif(stmt, reset)
+  end
+
+  defp stmt_status_nif(_stmt, _reset), do: :erlang.nif_error(:undef)
+
+  @typedoc "See `scan_status/2`."
+  @type scan_status :: %{
+          name: String.t() | nil,
+          explain: String.t() | nil,
+          loops: integer,
+          rows: integer,
+          estimate: float,
+          select_id: integer,
+          parent_id: integer,
+          cycles: integer
+        }
+
+  @doc """
+  Returns per-loop counters of a prepared statement using
+  [sqlite3_stmt_scanstatus_v2()](https://www.sqlite.org/c3ref/stmt_scanstatus.html).
+
+  Each element of the query plan reports how many times it ran (`loops`),
+  how many rows it visited (`rows`) against the planner's `estimate` and the
+  `cycles` it took, or -1 when not available. `select_id` and `parent_id` link
+  the elements into the same tree as `EXPLAIN QUERY PLAN` output.
+  With `reset: true` the counters are zeroed after being read.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> stmt = XQLite.prepare(db, "select * from json_each('[1, 2, 3]')")
+      iex> XQLite.fetch_all(stmt) |> length()
+      3
+      iex> XQLite.scan_status(stmt) |> Enum.map(& &1.rows) |> Enum.max()
+      3
+
+  """
+  @spec scan_status(stmt, [{:reset, boolean}]) :: [scan_status]
+  def scan_status(stmt, opts \\ []) do
+    reset = if Keyword.get(opts, :reset, false), do: 1, else: 0
+    scan_status_nif(stmt, reset)
+  end
+
+  defp scan_status_nif(_stmt, _reset), do: :erlang.nif_error(:undef)
+
   @doc """
   Tests for auto-commit mode.
 
@@ -506,6 +1113,49 @@ defmodule XQLite do
   @spec memory_used :: integer
   def memory_used, do: :erlang.nif_error(:undef)
 
+  @doc """
+  Returns global counters from [sqlite3_status64()](https://www.sqlite.org/c3ref/status.html)
+  as `{current, highwater}` tuples.
+
+  With `reset: true` the highwater marks are reset to the current values after being read.
+
+      iex> XQLite.open(":memory:", [:readonly])
+      iex> %{memory_used: {current, highwater}} = XQLite.status()
+      iex> current > 0 and highwater >= current
+      true
+
+  """
+  @spec status([{:reset, boolean}]) :: %{atom => {integer, integer}}
+  def status(opts \\ []) do
+    reset = if Keyword.get(opts, :reset, false), do: 1, else: 0
+    status_nif(reset)
+  end
+
+  defp status_nif(_reset), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Returns connection counters from
+  [sqlite3_db_status()](https://www.sqlite.org/c3ref/db_status.html).
+
+  `cache_used`, `schema_used` and `stmt_used` are in bytes. `cache_hit`, `cache_miss`,
+  `cache_write` and `cache_spill` count pages and are useful for tuning `cache_size`.
+  With `reset: true` the counters that support it are zeroed after being read.
+
+      iex> db = XQLite.open(":memory:", [:readwrite])
+      iex> XQLite.exec(db, "create table test(x)")
+      iex> %{cache_used: cache_used, schema_used: schema_used} = XQLite.db_status(db)
+      iex> cache_used > 0 and schema_used > 0
+      true
+
+  """
+  @spec db_status(db, [{:reset, boolean}]) :: %{atom => integer}
+  def db_status(db, opts \\ []) do
+    reset = if Keyword.get(opts, :reset, false), do: 1, else: 0
+    db_status_nif(db, reset)
+  end
+
+  defp db_status_nif(_db, _reset), do: :erlang.nif_error(:undef)
+
   @doc """
   Returns number of columns in a result set.
 
@@ -560,4 +1210,139 @@ defmodule XQLite do
   end
 
   defp exec_nif(_db, _sql), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Enables or disables recording of per-call timings on a connection.
+
+  When enabled, `step/1`, `step/2`, `adaptive_step/2`, `fetch_all/1`, `insert_all/4`
+  and `exec/2` record their start time, duration, rows, VM steps and payload bytes
+  into a lock-free ring buffer of `capacity` events. Events recorded while the buffer
+  is full are dropped and counted. Use `drain_telemetry/2` or `XQLite.Telemetry`
+  to read them.
+
+  The buffer is allocated on first use and keeps its capacity for the lifetime of
+  the connection. Enabling it again with a different capacity raises `ArgumentError`
+  and leaves the recording state unchanged.
+
+      iex> db = XQLite.open(":memory:", [:readwrite])
+      iex> XQLite.set_telemetry(db, 1024)
+      :ok
+      iex> XQLite.set_telemetry(db, false)
+      :ok
+
+  """
+  @spec set_telemetry(db, pos_integer | false) :: :ok
+  def set_telemetry(db, false), do: set_telemetry_nif(db, 0)
+  def set_telemetry(db, capacity) when capacity > 0, do: set_telemetry_nif(db, capacity)
+
+  defp set_telemetry_nif(_db, _capacity), do: :erlang.nif_error(:undef)
+
+  @typedoc """
+  A call recorded with `set_telemetry/2`.
+
+  Times are `:erlang.monotonic_time(:nanosecond)` values, `rc` is the SQLite
+  result code of the call (0, 100 or 101 on success).
+  """
+  @type telemetry_event :: {
+          op :: :step | :fetch_all | :insert_all | :exec,
+          start :: integer,
+          duration :: non_neg_integer,
+          rows :: non_neg_integer,
+          vm_steps :: non_neg_integer,
+          bytes :: non_neg_integer,
+          rc :: integer
+        }
+
+  @doc """
+  Takes up to `max` recorded events, oldest first, along with the number
+  of events dropped since the last drain.
+
+      iex> db = XQLite.open(":memory:", [:readwrite])
+      iex> XQLite.set_telemetry(db, 1024)
+      iex> XQLite.exec(db, "create table test(x)")
+      iex> {[{:exec, _start, _duration, 0, 0, 0, 0}], 0} = XQLite.drain_telemetry(db)
+
+  """
+  @spec drain_telemetry(db, non_neg_integer) :: {[telemetry_event], non_neg_integer}
+  def drain_telemetry(db, max \\ 1000), do: drain_telemetry_nif(db, max)
+
+  defp drain_telemetry_nif(_db, _max), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Captures statements running longer than a threshold using
+  [sqlite3_trace_v2()](https://www.sqlite.org/c3ref/trace_v2.html) with `SQLITE_TRACE_PROFILE`.
+
+  The expanded SQL (see `expanded_sql/1`) of every statement taking at least
+  `:threshold` milliseconds is kept in a buffer of `:capacity` entries, defaults
+  to 100, replacing the oldest ones once full. Read the entries with `slow_queries/1`,
+  pass `false` to stop capturing. With the `:pid` option a background thread takes the
+  entries as they are captured and sends them to that process as
+  `{:xqlite_slow_query, sql, nanoseconds}` messages. Entries it drops
+  because it fell more than `:capacity` behind are counted by `slow_queries/1`.
+
+  Profiling isn't free: while it's on, SQLite reads the VFS clock when each statement
+  starts and finishes, whether it turns out to be slow or not. That clock only has
+  millisecond resolution, so durations are multiples of a millisecond and statements
+  shorter than one may be reported as taking zero.
+
+      iex> db = XQLite.open(":memory:", [:readonly])
+      iex> XQLite.set_slow_query_log(db, threshold: 0)
+      :ok
+      iex> stmt = XQLite.prepare(db, "select ?")
+      iex> XQLite.bind_integer(stmt, 1, 42)
+      iex> XQLite.fetch_all(stmt)
+      iex> {[{"select 42", ns}], 0} = XQLite.slow_queries(db)
+      iex> ns >= 0
+      true
+
+  """
+  @type slow_query_log_opt :: {:threshold, number} | {:capacity, pos_integer} | {:pid, pid}
+
+  @spec set_slow_query_log(db, [slow_query_log_opt] | false) :: :ok
+  def set_slow_query_log(db, false), do: set_slow_query_log_nif(db, -1, 1, nil)
+
+  def set_slow_query_log(db, opts) do
+    threshold = round(Keyword.fetch!(opts, :threshold) * 1_000_000)
+    capacity = Keyword.get(opts, :capacity, 100)
+    set_slow_query_log_nif(db, threshold, capacity, Keyword.get(opts, :pid))
+  end
+
+  defp set_slow_query_log_nif(_db, _threshold, _capacity, _pid), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Takes the statements captured with `set_slow_query_log/2` as `{sql, nanoseconds}`
+  tuples, oldest first, along with the number of entries replaced since the last call.
+  """
+  @spec slow_queries(db) :: {[{String.t(), non_neg_integer}], non_neg_integer}
+  def slow_queries(db), do: dirty_io_slow_queries_nif(db)
+
+  defp dirty_io_slow_queries_nif(_db), do: :erlang.nif_error(:undef)
+
+  @doc """
+  Binds, executes and resets several prepared statements in a single dirty NIF call.
+
+  Takes `{stmt, params}` pairs, with one param per statement parameter, and
+  returns all rows of each statement in the same order. Param types are inferred:
+  integers, floats, binaries (as text), `{:blob, binary}`, `nil` and booleans
+  (as 1 and 0). Bindings are cleared afterwards.
+
+  With `savepoint: true` the statements run inside a savepoint that is released
+  when all of them succeed and rolled back if any of them fails.
+
+      iex> db = XQLite.open(":memory:", [:readwrite])
+      iex> XQLite.exec(db, "CREATE TABLE users (name TEXT, admin INTEGER)")
+      iex> insert = XQLite.prepare(db, "INSERT INTO users VALUES (?, ?)")
+      iex> select = XQLite.prepare(db, "SELECT * FROM users WHERE admin = ?")
+      iex> batch = [{insert, ["Alice", true]}, {insert, ["Bob", false]}, {select, [1]}]
+      iex> XQLite.run_batch(db, batch)
+      [[], [], [["Alice", 1]]]
+
+  """
+  @spec run_batch(db, [{stmt, [term]}], [{:savepoint, boolean}]) :: [[row]]
+  def run_batch(db, batch, opts \\ []) do
+    savepoint = if Keyword.get(opts, :savepoint, false), do: 1, else: 0
+    dirty_io_run_batch_nif(db, batch, savepoint)
+  end
+
+  defp dirty_io_run_batch_nif(_db, _batch, _savepoint), do: :erlang.nif_error(:undef)
 end
@@ -0,0 +1,108 @@
+defmodule XQLite.Telemetry do
+  @moduledoc """
+  Periodically drains the events recorded with `XQLite.set_telemetry/2`
+  and emits them as [`:telemetry`](https://hex.pm/packages/telemetry) events.
+
+  `:telemetry` is not a dependency of XQLite, add it to your project to use this module.
+
+      children = [
+        {XQLite.Telemetry, db: db, interval: :timer.seconds(1), metadata: %{repo: :main}}
+      ]
+
+  For each recorded call, `[:xqlite, op, :stop]` is emitted where `op` is one of
+  `:step`, `:fetch_all`, `:insert_all` or `:exec`, with measurements:
+
+    * `:monotonic_time` and `:duration` in `:native` time units
+    * `:rows`, `:vm_steps` and `:bytes`
+
+  and metadata of `:db`, `:error` (the SQLite result code or `nil`) merged into
+  the configured `:metadata`. Dropped events are reported as
+  `[:xqlite, :telemetry, :dropped]` with a `:count` measurement.
+
+  Options:
+
+    * `:db` - the connection to instrument, required
+    * `:capacity` - ring buffer capacity, defaults to 1024. Must match the capacity
+      of earlier `XQLite.set_telemetry/2` calls on the connection
+    * `:interval` - polling interval in milliseconds, defaults to 1000
+    * `:metadata` - extra metadata for every event, defaults to `%{}`
+
+  """
+
+  use GenServer
+  @compile {:no_warn_undefined, :telemetry}
+
+  # events drained per call
+  @drain_max 1000
+
+  @doc false
+  def child_spec(opts) do
+    %{id: {__MODULE__, Keyword.fetch!(opts, :db)}, start: {__MODULE__, :start_link, [opts]}}
+  end
+
+  @doc "Enables telemetry on the connection and starts polling it."
+  @spec start_link(Keyword.t()) :: GenServer.on_start()
+  def start_link(opts) do
+    {gen_opts, opts} = Keyword.split(opts, [:name])
+    GenServer.start_link(__MODULE__, opts, gen_opts)
+  end
+
+  @impl true
+  def init(opts) do
+    Process.flag(:trap_exit, true)
+
+    db = Keyword.fetch!(opts, :db)
+    :ok = XQLite.set_telemetry(db, Keyword.get(opts, :capacity, 1024))
+
+    state = %{
+      db: db,
+      interval: Keyword.get(opts, :interval, 1000),
+      metadata: Keyword.get(opts, :metadata, %{})
+    }
+
+    schedule(state)
+    {:ok, state}
+  end
+
+  @impl true
+  def handle_info(:poll, state) do
+    emit(state)
+    schedule(state)
+    {:noreply, state}
+  end
+
+  @impl true
+  def terminate(_reason, %{db: db} = state) do
+    emit(state)
+    XQLite.set_telemetry(db, false)
+  end
+
+  defp schedule(%{interval: interval}) do
+    Process.send_after(self(), :poll, interval)
+  end
+
+  defp emit(%{db: db, metadata: metadata} = state) do
+    {events, dropped} = XQLite.drain_telemetry(db, @drain_max)
+    metadata = Map.put(metadata, :db, db)
+
+    Enum.each(events, fn {op, start, duration, rows, vm_steps, bytes, rc} ->
+      measurements = %{
+        monotonic_time: System.convert_time_unit(start, :nanosecond, :native),
+        duration: System.convert_time_unit(duration, :nanosecond, :native),
+        rows: rows,
+        vm_steps: vm_steps,
+        bytes: bytes
+      }
+
+      error = if rc in [0, 100, 101], do: nil, else: rc
+      :telemetry.execute([:xqlite, op, :stop], measurements, Map.put(metadata, :error, error))
+    end)
+
+    if dropped > 0 do
+      :telemetry.execute([:xqlite, :telemetry, :dropped], %{count: dropped}, metadata)
+    end
+
+    # keep draining without waiting for the next tick while the buffer is busy
+    if length(events) == @drain_max, do: emit(state)
+  end
+end
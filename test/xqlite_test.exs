@@ -34,6 +34,38 @@ defmodule XQLiteTest do
     end
   end
 
+  describe "memory allocator" do
+    test "accounts for small and large allocations" do
+      {pid, monitor} =
+        :proc_lib.spawn_opt(
+          fn ->
+            db = XQLite.open(":memory:", [:readwrite])
+            XQLite.exec(db, "create table blobs(b blob)")
+            insert = XQLite.prepare(db, "insert into blobs(b) values(?)")
+
+            for size <- [0, 1, 55, 56, 57, 1000, 2040, 2041, 100_000, 5_000_000] do
+              blob = :binary.copy(<<size::8>>, size)
+              XQLite.bind_blob(insert, 1, blob)
+              assert :done = XQLite.step(insert)
+              XQLite.reset(insert)
+            end
+
+            assert [[10, 5_000_000]] =
+                     prepare_fetch_all(db, "select count(*), max(length(b)) from blobs")
+
+            XQLite.exec(db, "update blobs set b = b || b")
+            XQLite.finalize(insert)
+            XQLite.close(db)
+          end,
+          [:monitor]
+        )
+
+      assert_receive {:DOWN, ^monitor, :process, ^pid, :normal}
+      await_until(fn -> XQLite.memory_used() == 0 end)
+      assert XQLite.memory_used() == 0
+    end
+  end
+
   describe "close/1" do
     setup do
       {:ok, db: XQLite.open(":memory:", [:readonly])}
@@ -64,6 +96,84 @@ defmodule XQLiteTest do
     end
   end
 
+  describe "prepare_cached/2" do
+    setup do
+      {:ok, db: XQLite.open(":memory:", [:readonly])}
+    end
+
+    test "returns a reset statement on hit", %{db: db} do
+      stmt = XQLite.prepare_cached(db, "select ?")
+      XQLite.bind_integer(stmt, 1, 42)
+      assert {:row, [42]} = XQLite.unsafe_step(stmt)
+
+      assert ^stmt = XQLite.prepare_cached(db, "select ?")
+      assert {:row, [nil]} = XQLite.unsafe_step(stmt)
+    end
+
+    test "re-prepares a finalized statement", %{db: db} do
+      stmt = XQLite.prepare_cached(db, "select 1")
+      XQLite.finalize(stmt)
+
+      refute (fresh = XQLite.prepare_cached(db, "select 1")) == stmt
+      assert {:row, [1]} = XQLite.unsafe_step(fresh)
+      assert ^fresh = XQLite.prepare_cached(db, "select 1")
+    end
+
+    test "raises on a closed connection", %{db: db} do
+      XQLite.prepare_cached(db, "select 1")
+      XQLite.close(db)
+
+      assert_raise ArgumentError, fn -> XQLite.prepare_cached(db, "select 1") end
+      assert_raise ArgumentError, fn -> XQLite.prepare_cached(db, "select 2") end
+    end
+
+    test "evicts least recently used statements", %{db: db} do
+      XQLite.set_stmt_cache_capacity(db, 2)
+
+      one = XQLite.prepare_cached(db, "select 1")
+      two = XQLite.prepare_cached(db, "select 2")
+      assert ^one = XQLite.prepare_cached(db, "select 1")
+      three = XQLite.prepare_cached(db, "select 3")
+
+      assert ^one = XQLite.prepare_cached(db, "select 1")
+      assert ^three = XQLite.prepare_cached(db, "select 3")
+      refute two == XQLite.prepare_cached(db, "select 2")
+
+      # evicted statements stay usable while referenced
+      assert {:row, [2]} = XQLite.unsafe_step(two)
+
+      assert XQLite.stmt_cache_stats(db) == %{
+               hits: 3,
+               misses: 4,
+               evictions: 2,
+               size: 2,
+               capacity: 2
+             }
+    end
+
+    test "raises on invalid sql", %{db: db} do
+      assert_raise ErlangError, ~r/syntax error/, fn -> XQLite.prepare_cached(db, "selec 1") end
+      assert %{size: 0, misses: 1} = XQLite.stmt_cache_stats(db)
+    end
+
+    test "releases cached statements on close" do
+      {pid, monitor} =
+        :proc_lib.spawn_opt(
+          fn ->
+            db = XQLite.open(":memory:", [:readonly])
+            XQLite.prepare_cached(db, "select 1")
+            XQLite.prepare_cached(db, "select 2")
+            XQLite.close(db)
+          end,
+          [:monitor]
+        )
+
+      assert_receive {:DOWN, ^monitor, :process, ^pid, :normal}
+      await_until(fn -> XQLite.memory_used() == 0 end)
+      assert XQLite.memory_used() == 0
+    end
+  end
+
   describe "stmt destructor" do
     test "finalizes stmt on gc" do
       {pid, monitor} =
@@ -125,6 +235,22 @@ defmodule XQLiteTest do
       XQLite.bind_integer(stmt, 1, 0xFFFFFFFF + 1)
       assert {:row, [0x100000000]} = XQLite.unsafe_step(stmt)
     end
+
+    test "decodes integers around the int32 and int64 limits", %{stmt: stmt} do
+      for integer <- [
+            -0x80000001,
+            -0x80000000,
+            0,
+            0x7FFFFFFF,
+            0x80000000,
+            -0x8000000000000000,
+            0x7FFFFFFFFFFFFFFF
+          ] do
+        XQLite.bind_integer(stmt, 1, integer)
+        assert {:row, [^integer]} = XQLite.unsafe_step(stmt)
+        XQLite.reset(stmt)
+      end
+    end
   end
 
   describe "bind_text/4" do
@@ -140,6 +266,68 @@ defmodule XQLiteTest do
     end
   end
 
+  describe "bind_blob/3 with large binaries" do
+    setup do
+      db = XQLite.open(":memory:", [:readonly])
+      stmt = XQLite.prepare(db, "select ?, ?")
+      {:ok, db: db, stmt: stmt}
+    end
+
+    test "keeps bound binaries alive after the caller drops them", %{stmt: stmt} do
+      XQLite.bind_blob(stmt, 1, :binary.copy(<<1>>, 100_000))
+      XQLite.bind_text(stmt, 2, :binary.copy("a", 1000))
+      :erlang.garbage_collect()
+
+      assert {:row, [blob, text]} = XQLite.unsafe_step(stmt)
+      assert blob == :binary.copy(<<1>>, 100_000)
+      assert text == :binary.copy("a", 1000)
+    end
+
+    test "rebinds many times", %{stmt: stmt} do
+      for i <- 1..1000 do
+        XQLite.reset(stmt)
+        blob = :binary.copy(<<i::32>>, 100)
+        XQLite.bind_blob(stmt, 1, blob)
+
+        if rem(i, 2) == 0,
+          do: XQLite.bind_integer(stmt, 2, i),
+          else: XQLite.bind_text(stmt, 2, blob)
+
+        assert {:row, [^blob, second]} = XQLite.unsafe_step(stmt)
+        assert second in [i, blob]
+      end
+    end
+
+    test "clear_bindings/1 releases pinned binaries", %{stmt: stmt} do
+      XQLite.bind_blob(stmt, 1, :binary.copy(<<1>>, 100_000))
+      XQLite.clear_bindings(stmt)
+      assert {:row, [nil, nil]} = XQLite.unsafe_step(stmt)
+    end
+
+    test "survives concurrent binds on a shared statement", %{stmt: stmt} do
+      1..8
+      |> Enum.map(fn i ->
+        Task.async(fn ->
+          for j <- 1..500 do
+            case rem(j, 3) do
+              0 -> XQLite.bind_blob(stmt, 1, :binary.copy(<<i>>, 1000))
+              1 -> XQLite.bind_integer(stmt, 1, j)
+              2 -> XQLite.clear_bindings(stmt)
+            end
+          end
+        end)
+      end)
+      |> Task.await_many()
+
+      XQLite.bind_text(stmt, 2, :binary.copy("a", 1000))
+      :erlang.garbage_collect()
+
+      assert {:row, [first, second]} = XQLite.unsafe_step(stmt)
+      assert first == nil or is_integer(first) or byte_size(first) == 1000
+      assert second == :binary.copy("a", 1000)
+    end
+  end
+
   describe "step/3" do
     setup do
       db = XQLite.open(":memory:", [:readonly])
@@ -206,6 +394,267 @@ defmodule XQLiteTest do
     end
   end
 
+  describe "prepare/3 with :sub_binaries" do
+    setup do
+      db = XQLite.open(":memory:", [:readonly])
+
+      sql = """
+      with recursive cte(x) as (
+        values(1)
+        union all
+        select x + 1 from cte where x < 1000
+      )
+      select x, 'hello' || x, cast(x as blob), '', null from cte
+      """
+
+      {:ok, db: db, sql: sql}
+    end
+
+    test "returns the same rows", %{db: db, sql: sql} do
+      stmt = XQLite.prepare(db, sql, [:sub_binaries])
+      assert XQLite.fetch_all(stmt) == prepare_fetch_all(db, sql)
+      assert XQLite.yielding_fetch_all(stmt) == prepare_fetch_all(db, sql)
+      assert {:rows, [[1, "hello1", "1", "", nil] | _]} = XQLite.step(stmt, 10)
+    end
+
+    test "slices cells from one binary per batch", %{db: db, sql: sql} do
+      stmt = XQLite.prepare(db, sql, [:sub_binaries])
+      [[_, first, _, _, _], [_, second, _, _, _] | _] = XQLite.fetch_all(stmt)
+
+      assert :binary.referenced_byte_size(first) == :binary.referenced_byte_size(second)
+      assert :binary.referenced_byte_size(first) > 5000
+    end
+  end
+
+  describe "yielding_fetch_all/1" do
+    setup do
+      db = XQLite.open(":memory:", [:readonly])
+
+      stmt =
+        XQLite.prepare(db, """
+        with recursive cte(x) as (
+          values(1)
+          union all
+          select x + 1 from cte where x < ?
+        )
+        select x, 'hello' || x from cte
+        """)
+
+      {:ok, db: db, stmt: stmt}
+    end
+
+    test "fetches all rows across reschedules", %{stmt: stmt} do
+      XQLite.bind_integer(stmt, 1, 100_000)
+      rows = XQLite.yielding_fetch_all(stmt)
+
+      assert length(rows) == 100_000
+      assert hd(rows) == [1, "hello1"]
+      assert List.last(rows) == [100_000, "hello100000"]
+      assert rows == XQLite.fetch_all(stmt)
+    end
+
+    test "can be interrupted between reschedules", %{db: db, stmt: stmt} do
+      XQLite.bind_integer(stmt, 1, 10_000_000_000)
+
+      spawn(fn ->
+        :timer.sleep(10)
+        XQLite.interrupt(db)
+      end)
+
+      assert_raise ErlangError, ~r/interrupted/, fn -> XQLite.yielding_fetch_all(stmt) end
+    end
+
+    test "moves expensive steps to a dirty scheduler", %{db: db} do
+      stmt =
+        XQLite.prepare(db, """
+        with recursive cte(x) as (values(1) union all select x + 1 from cte where x < 100000)
+        select x from cte order by x desc limit 2
+        """)
+
+      assert XQLite.yielding_fetch_all(stmt) == [[100_000], [99_999]]
+      assert XQLite.yielding_fetch_all(stmt) == [[100_000], [99_999]]
+    end
+
+    test "continues statements that were already stepped", %{stmt: stmt} do
+      XQLite.bind_integer(stmt, 1, 3)
+      assert {:row, [1, "hello1"]} = XQLite.step(stmt)
+      assert XQLite.yielding_fetch_all(stmt) == [[2, "hello2"], [3, "hello3"]]
+    end
+
+    test "respects the statement's timeout", %{stmt: stmt} do
+      XQLite.bind_integer(stmt, 1, 10_000_000_000)
+      :ok = XQLite.set_timeout(stmt, 20)
+      assert_raise ErlangError, ~r/timeout/, fn -> XQLite.yielding_fetch_all(stmt) end
+    end
+  end
+
+  describe "fetch_columns/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readonly])
+
+      sql = """
+      with recursive cte(x) as (
+        values(1)
+        union all
+        select x + 1 from cte where x < 1000
+      )
+      select x as i, x / 2.0 as f, 'hello' || x as t, iif(x = 500, null, x) as n from cte
+      """
+
+      {:ok, db: db, sql: sql}
+    end
+
+    test "transposes rows", %{db: db, sql: sql} do
+      rows = prepare_fetch_all(db, sql)
+      columns = rows |> Enum.zip() |> Enum.map(&Tuple.to_list/1)
+      assert XQLite.fetch_columns(XQLite.prepare(db, sql)) == {["i", "f", "t", "n"], columns}
+    end
+
+    test "packs numeric columns", %{db: db, sql: sql} do
+      {names, [i, f, t, n]} = XQLite.fetch_columns(XQLite.prepare(db, sql), packed: true)
+
+      assert names == ["i", "f", "t", "n"]
+      assert for(<<x::64-signed-native <- i>>, do: x) == Enum.to_list(1..1000)
+      assert for(<<x::64-float-native <- f>>, do: x) == Enum.map(1..1000, &(&1 / 2))
+      assert length(t) == 1000
+
+      # a NULL halfway through falls back to a list
+      assert n == Enum.map(1..1000, fn x -> if x == 500, do: nil, else: x end)
+    end
+
+    test "returns lists when there are no rows", %{db: db} do
+      stmt = XQLite.prepare(db, "select 1 as a where false")
+      assert XQLite.fetch_columns(stmt, packed: true) == {["a"], [[]]}
+    end
+  end
+
+  describe "stream/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readonly])
+
+      stmt =
+        XQLite.prepare(db, """
+        with recursive cte(x) as (
+          values(1)
+          union all
+          select x + 1 from cte where x < ?
+        )
+        select x from cte
+        """)
+
+      {:ok, db: db, stmt: stmt}
+    end
+
+    test "emits rows in chunks", %{stmt: stmt} do
+      XQLite.bind_integer(stmt, 1, 1000)
+      chunks = stmt |> XQLite.stream(chunk_size: 300) |> Enum.to_list()
+
+      assert Enum.map(chunks, &length/1) == [300, 300, 300, 100]
+      assert Enum.concat(chunks) == Enum.map(1..1000, &[&1])
+    end
+
+    test "resets the statement when halted", %{stmt: stmt} do
+      XQLite.bind_integer(stmt, 1, 1_000_000)
+      assert [[[1], [2]]] = stmt |> XQLite.stream(chunk_size: 2) |> Enum.take(1)
+      assert {:row, [1]} = XQLite.step(stmt)
+    end
+
+    test "raises on interrupt between chunks", %{db: db, stmt: stmt} do
+      XQLite.bind_integer(stmt, 1, 1_000_000)
+
+      stream =
+        stmt
+        |> XQLite.stream(chunk_size: 10)
+        |> Stream.each(fn _chunk -> XQLite.interrupt(db) end)
+
+      assert_raise ErlangError, ~r/interrupted/, fn -> Stream.run(stream) end
+      assert {:row, [1]} = XQLite.step(stmt)
+    end
+  end
+
+  describe "worker" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite, :worker])
+      XQLite.exec(db, "create table test(i integer) strict")
+      {:ok, db: db}
+    end
+
+    test "executes commands in submission order", %{db: db} do
+      insert = XQLite.prepare(db, "insert into test(i) values(?)")
+      select = XQLite.prepare(db, "select i from test order by i")
+
+      refs = [
+        XQLite.async_exec(db, "begin immediate"),
+        XQLite.async_insert_all(db, insert, [:integer], [[1], [2], [3]]),
+        XQLite.async_exec(db, "commit"),
+        XQLite.async_step(db, select, 2),
+        XQLite.async_step(db, select, 2),
+        XQLite.async_fetch_all(db, select)
+      ]
+
+      assert Enum.map(refs, &XQLite.await/1) == [
+               :ok,
+               :done,
+               :ok,
+               {:rows, [[1], [2]]},
+               {:done, [[3]]},
+               [[1], [2], [3]]
+             ]
+    end
+
+    test "pipelines requests from many processes", %{db: db} do
+      insert = XQLite.prepare(db, "insert into test(i) values(?)")
+
+      1..100
+      |> Enum.map(fn i ->
+        Task.async(fn -> XQLite.await(XQLite.async_insert_all(db, insert, [:integer], [[i]])) end)
+      end)
+      |> Enum.each(fn task -> assert :done = Task.await(task) end)
+
+      assert prepare_fetch_all(db, "select count(*) from test") == [[100]]
+    end
+
+    test "raises errors on await", %{db: db} do
+      ref = XQLite.async_exec(db, "insert into missing values(1)")
+
+      assert_raise ErlangError, ~r/no such table: missing/, fn -> XQLite.await(ref) end
+    end
+
+    test "requires a worker" do
+      db = XQLite.open(":memory:", [:readonly])
+      assert_raise ArgumentError, fn -> XQLite.async_exec(db, "select 1") end
+    end
+
+    test "rejects statements from other connections", %{db: db} do
+      other = XQLite.open(":memory:", [:readonly])
+      stmt = XQLite.prepare(other, "select 1")
+      assert_raise ArgumentError, fn -> XQLite.async_fetch_all(db, stmt) end
+    end
+
+    test "rejects commands after close", %{db: db} do
+      ref = XQLite.async_exec(db, "insert into test(i) values(1)")
+      assert :ok = XQLite.close(db)
+      assert :ok = XQLite.await(ref)
+      assert_raise ArgumentError, fn -> XQLite.async_exec(db, "select 1") end
+    end
+
+    test "stops worker on gc" do
+      {pid, monitor} =
+        :proc_lib.spawn_opt(
+          fn ->
+            db = XQLite.open(":memory:", [:readonly, :worker])
+            stmt = XQLite.prepare(db, "select 1")
+            XQLite.async_fetch_all(db, stmt)
+          end,
+          [:monitor]
+        )
+
+      assert_receive {:DOWN, ^monitor, :process, ^pid, :normal}
+      await_until(fn -> XQLite.memory_used() == 0 end)
+      assert XQLite.memory_used() == 0
+    end
+  end
+
   describe "insert_all/4" do
     setup do
       db = XQLite.open(":memory:", [:readwrite])
@@ -238,6 +687,760 @@ defmodule XQLiteTest do
     end
   end
 
+  describe "insert_all/4 with :batch" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+      XQLite.exec(db, "create table test(i integer, txt text) strict")
+      {:ok, db: db}
+    end
+
+    test "inserts full batches and the tail", %{db: db} do
+      insert = XQLite.prepare(db, "insert into test(i, txt) values (?, ?)")
+      rows = Enum.map(1..1003, fn i -> [i, "row #{i}"] end)
+
+      XQLite.exec(db, "begin immediate")
+      assert XQLite.insert_all(insert, [:integer, :text], rows, batch: 100) == 1003
+      XQLite.exec(db, "commit")
+
+      assert prepare_fetch_all(db, "select * from test order by rowid") == rows
+    end
+
+    test "keeps the suffix of the statement", %{db: db} do
+      XQLite.exec(db, "create unique index test_i on test(i)")
+      insert = XQLite.prepare(db, "insert into test values(?,?) on conflict do nothing;")
+      rows = [[1, "a"], [1, "b"], [2, "c"], [3, "d"], [2, "e"]]
+
+      assert XQLite.insert_all(insert, [:integer, :text], rows, batch: 2) == 5
+      expected = [[1, "a"], [2, "c"], [3, "d"]]
+      assert prepare_fetch_all(db, "select * from test order by i") == expected
+    end
+
+    test "falls back to single rows when the statement can't be rewritten", %{db: db} do
+      insert = XQLite.prepare(db, "insert into test(i, txt) values (?1, ?2)")
+      rows = [[1, "a"], [2, "b"], [3, "c"]]
+
+      assert XQLite.insert_all(insert, [:integer, :text], rows, batch: 2) == 3
+      assert prepare_fetch_all(db, "select * from test order by rowid") == rows
+    end
+
+    test "raises on malformed rows", %{db: db} do
+      insert = XQLite.prepare(db, "insert into test(i, txt) values (?, ?)")
+
+      assert_raise ArgumentError, fn ->
+        XQLite.insert_all(insert, [:integer, :text], [[1, "a"], [2]], batch: 2)
+      end
+    end
+
+    test "undoes the whole batch of a failing row", %{db: db} do
+      XQLite.exec(db, "create unique index test_i on test(i)")
+      insert = XQLite.prepare(db, "insert into test(i, txt) values (?, ?)")
+      rows = [[1, "a"], [2, "b"], [3, "c"], [4, "d"], [1, "dup"], [6, "f"], [7, "g"]]
+
+      for {batch, survivors} <- [{3, [1, 2, 3]}, {1, [1, 2, 3, 4]}] do
+        XQLite.exec(db, "begin immediate")
+
+        assert_raise ErlangError, ~r/UNIQUE constraint failed/, fn ->
+          XQLite.insert_all(insert, [:integer, :text], rows, batch: batch)
+        end
+
+        # the failing statement is rolled back, the transaction stays open
+        XQLite.exec(db, "commit")
+        expected = Enum.map(survivors, &[&1])
+        assert prepare_fetch_all(db, "select i from test order by i") == expected
+        XQLite.exec(db, "delete from test")
+      end
+    end
+  end
+
+  describe "insert_all/4 with :transaction" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+      XQLite.exec(db, "create table test(i integer primary key, txt text) strict")
+      insert = XQLite.prepare(db, "insert into test(i, txt) values (?, ?)")
+      {:ok, db: db, insert: insert}
+    end
+
+    test "commits in chunks and returns the inserted count", %{db: db, insert: insert} do
+      rows = Enum.map(1..1000, fn i -> [i, "row #{i}"] end)
+
+      opts = [transaction: true, commit_every: 64, batch: 10]
+      assert XQLite.insert_all(insert, [:integer, :text], rows, opts) == 1000
+
+      assert XQLite.get_autocommit(db) == 1
+      assert prepare_fetch_all(db, "select * from test order by i") == rows
+    end
+
+    test "commits by bytes", %{db: db, insert: insert} do
+      rows = Enum.map(1..100, fn i -> [i, String.duplicate("x", 100)] end)
+
+      opts = [transaction: true, commit_bytes: 1000]
+      assert XQLite.insert_all(insert, [:integer, :text], rows, opts) == 100
+
+      assert prepare_fetch_all(db, "select count(*) from test") == [[100]]
+    end
+
+    test "rolls back the failing chunk", %{db: db, insert: insert} do
+      rows = Enum.map(1..10, fn i -> [i, "row"] end) ++ [[5, "duplicate"]]
+
+      assert_raise ErlangError, ~r/UNIQUE constraint failed/, fn ->
+        XQLite.insert_all(insert, [:integer, :text], rows, transaction: true, commit_every: 8)
+      end
+
+      assert XQLite.get_autocommit(db) == 1
+      assert prepare_fetch_all(db, "select count(*) from test") == [[8]]
+    end
+
+    test "requires :transaction for chunked commits", %{insert: insert} do
+      assert_raise ArgumentError, fn ->
+        XQLite.insert_all(insert, [:integer, :text], [[1, "a"]], commit_every: 1)
+      end
+    end
+  end
+
+  describe "bind_plan/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+      XQLite.exec(db, "create table test(i integer, txt text) strict")
+      insert = XQLite.prepare(db, "insert into test(i, txt) values (?, ?)")
+      {:ok, db: db, insert: insert}
+    end
+
+    test "is reusable across calls and insert functions", %{db: db, insert: insert} do
+      plan = XQLite.bind_plan(insert, [:integer, :text])
+
+      assert :done = XQLite.insert_all(insert, plan, [[1, "a"], [2, nil]])
+      assert XQLite.insert_all(insert, plan, [[3, "c"], [4, "d"], [5, "e"]], batch: 2) == 3
+      assert :done = XQLite.insert_columns(insert, plan, [[6], ["f"]])
+
+      assert prepare_fetch_all(db, "select i from test order by rowid") == Enum.map(1..6, &[&1])
+    end
+
+    test "validates types against the statement", %{db: db, insert: insert} do
+      assert_raise ArgumentError, fn -> XQLite.bind_plan(insert, [:integer]) end
+      assert_raise ArgumentError, fn -> XQLite.bind_plan(insert, [:integer, :text, :blob]) end
+      assert_raise ArgumentError, fn -> XQLite.insert_all(insert, [:integer], [[1, "a"]]) end
+
+      plan = XQLite.bind_plan(XQLite.prepare(db, "select ?"), [:integer])
+      assert_raise ArgumentError, fn -> XQLite.insert_all(insert, plan, [[1, "a"]]) end
+    end
+
+    test "raises on values not matching the plan", %{insert: insert} do
+      plan = XQLite.bind_plan(insert, [:integer, :text])
+      assert_raise ArgumentError, fn -> XQLite.insert_all(insert, plan, [["1", "a"]]) end
+    end
+  end
+
+  describe "insert_columns/3" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+      XQLite.exec(db, "create table test(i integer, f real, txt text, bin blob) strict")
+      insert = XQLite.prepare(db, "insert into test(i, f, txt, bin) values(?, ?, ?, ?)")
+      {:ok, db: db, insert: insert}
+    end
+
+    test "inserts lists and packed columns", %{db: db, insert: insert} do
+      ints = for i <- 1..100, into: <<>>, do: <<i * 0x100000000::64-signed-native>>
+      floats = for i <- 1..100, into: <<>>, do: <<i / 4::64-float-native>>
+      texts = Enum.map(1..100, &"text #{&1}")
+      blobs = Enum.map(1..100, fn i -> if rem(i, 2) == 0, do: nil, else: <<i>> end)
+
+      types = [:integer, :float, :text, :blob]
+
+      XQLite.exec(db, "begin immediate")
+      assert :done = XQLite.insert_columns(insert, types, [ints, floats, texts, blobs])
+      assert :done = XQLite.insert_columns(insert, types, [[1], [nil], ["a"], [<<>>]])
+      XQLite.exec(db, "commit")
+
+      expected =
+        Enum.map(1..100, fn i ->
+          [i * 0x100000000, i / 4, "text #{i}", if(rem(i, 2) == 0, do: nil, else: <<i>>)]
+        end)
+
+      expected = expected ++ [[1, nil, "a", ""]]
+      assert prepare_fetch_all(db, "select * from test order by rowid") == expected
+    end
+
+    test "raises on mismatched lengths", %{db: db, insert: insert} do
+      types = [:integer, :float, :text, :blob]
+
+      assert_raise ArgumentError, fn ->
+        XQLite.insert_columns(insert, types, [[1, 2], [1.0], ["a"], ["b"]])
+      end
+
+      assert_raise ArgumentError, fn ->
+        ints = <<1::64-native, 2::64-native>>
+        XQLite.insert_columns(insert, types, [ints, [1.0], ["a"], ["b"]])
+      end
+
+      assert_raise ArgumentError, fn ->
+        XQLite.insert_columns(insert, types, [[1], [1.0], ["a"]])
+      end
+
+      assert prepare_fetch_all(db, "select count(*) from test") == [[0]]
+    end
+  end
+
+  describe "adaptive_step/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+      {:ok, db: db}
+    end
+
+    test "steps cheap and expensive reads", %{db: db} do
+      stmt = XQLite.prepare(db, "select ?")
+      XQLite.bind_integer(stmt, 1, 42)
+      assert XQLite.adaptive_step(stmt) == {:row, [42]}
+      assert XQLite.adaptive_step(stmt) == :done
+
+      sql = """
+      with recursive c(x) as (values(1) union all select x + 1 from c where x < 100000)
+      select sum(x) from c
+      """
+
+      stmt = XQLite.prepare(db, sql)
+      assert XQLite.adaptive_step(stmt, 100) == {:row, [5_000_050_000]}
+      assert XQLite.adaptive_step(stmt, 100) == :done
+    end
+
+    test "runs writes only once", %{db: db} do
+      XQLite.exec(db, "create table test(x)")
+
+      sql = """
+      insert into test
+      with recursive c(x) as (values(1) union all select x + 1 from c where x < 10000)
+      select x from c
+      """
+
+      stmt = XQLite.prepare(db, sql)
+      assert XQLite.adaptive_step(stmt, 10) == :done
+      assert prepare_fetch_all(db, "select count(*) from test") == [[10000]]
+    end
+
+    test "leaves transactions open", %{db: db} do
+      XQLite.exec(db, "create table test(x); begin; insert into test values (1)")
+
+      sql = """
+      with recursive c(x) as (values(1) union all select x + 1 from c where x < 100000)
+      select count(*) from c, test
+      """
+
+      stmt = XQLite.prepare(db, sql)
+      assert XQLite.adaptive_step(stmt, 10) == {:row, [100_000]}
+      assert XQLite.get_autocommit(db) == 0
+    end
+  end
+
+  describe "set_timeout/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+
+      sql = """
+      with recursive c(x) as (values(1) union all select x + 1 from c where x < ?)
+      select sum(x) from c
+      """
+
+      {:ok, db: db, stmt: XQLite.prepare(db, sql)}
+    end
+
+    test "raises :timeout from every stepping function", %{stmt: stmt} do
+      :ok = XQLite.set_timeout(stmt, 10)
+      XQLite.bind_integer(stmt, 1, 10_000_000_000_000)
+
+      for call <- [
+            fn -> XQLite.step(stmt) end,
+            fn -> XQLite.step(stmt, 10) end,
+            fn -> XQLite.fetch_all(stmt) end,
+            fn -> XQLite.fetch_columns(stmt) end,
+            fn -> XQLite.adaptive_step(stmt) end,
+            fn -> XQLite.query_one(stmt, [10_000_000_000_000]) end,
+            fn -> XQLite.query_all(stmt, [10_000_000_000_000]) end
+          ] do
+        {time, _} = :timer.tc(fn -> assert_raise ErlangError, ~r/:timeout/, call end)
+        assert time < 1_000_000
+      end
+    end
+
+    test "resets the statement after a timeout", %{stmt: stmt} do
+      :ok = XQLite.set_timeout(stmt, 10)
+      assert_raise ErlangError, ~r/:timeout/, fn -> XQLite.query_one(stmt, [1.0e13]) end
+      assert XQLite.query_one(stmt, [10]) == [55]
+    end
+
+    test "doesn't affect fast calls and can be removed", %{stmt: stmt} do
+      :ok = XQLite.set_timeout(stmt, 1000)
+      assert XQLite.query_one(stmt, [100_000]) == [5_000_050_000]
+
+      :ok = XQLite.set_timeout(stmt, :infinity)
+      XQLite.bind_integer(stmt, 1, 1_000_000)
+      assert XQLite.fetch_all(stmt) == [[500_000_500_000]]
+    end
+
+    test "doesn't apply to finalized statements", %{stmt: stmt} do
+      :ok = XQLite.set_timeout(stmt, 10)
+      :ok = XQLite.finalize(stmt)
+      assert_raise ErlangError, fn -> XQLite.step(stmt) end
+    end
+
+    test "treats huge timeouts as none", %{stmt: stmt} do
+      :ok = XQLite.set_timeout(stmt, 0x7FFFFFFFFFFFFFFF)
+      assert XQLite.query_one(stmt, [10]) == [55]
+
+      assert_raise ArgumentError, fn -> XQLite.set_timeout(stmt, 0x8000000000000000) end
+    end
+
+    test "rolls back interrupted writes", %{db: db} do
+      XQLite.exec(db, "create table test(x)")
+
+      sql = """
+      insert into test
+      with recursive c(x) as (values(1) union all select x + 1 from c where x < 1e13)
+      select x from c
+      """
+
+      stmt = XQLite.prepare(db, sql)
+      :ok = XQLite.set_timeout(stmt, 10)
+      assert_raise ErlangError, ~r/:timeout/, fn -> XQLite.step(stmt) end
+      assert prepare_fetch_all(db, "select count(*) from test") == [[0]]
+    end
+  end
+
+  describe "stmt_status/2 and scan_status/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+      XQLite.exec(db, "create table test(a integer, b integer)")
+
+      XQLite.exec(db, """
+      insert into test
+      with recursive c(x) as (values(1) union all select x + 1 from c where x < 100)
+      select x, x % 10 from c
+      """)
+
+      {:ok, db: db}
+    end
+
+    test "counts full scans and sorts", %{db: db} do
+      stmt = XQLite.prepare(db, "select a from test where b = 1 order by a desc")
+      assert length(XQLite.fetch_all(stmt)) == 10
+
+      status = XQLite.stmt_status(stmt, reset: true)
+      assert status.fullscan_step == 99
+      assert status.sort == 1
+      assert status.run == 1
+      assert status.vm_step > 0
+      assert status.memused > 0
+
+      assert %{fullscan_step: 0, sort: 0, run: 0} = XQLite.stmt_status(stmt)
+    end
+
+    test "reports rows visited per loop", %{db: db} do
+      stmt = XQLite.prepare(db, "select * from test t1, test t2 where t1.a = t2.b")
+      XQLite.fetch_all(stmt)
+
+      loops = Enum.filter(XQLite.scan_status(stmt, reset: true), & &1.name)
+      assert length(loops) >= 2
+      assert Enum.all?(loops, &(&1.loops >= 1 and &1.rows >= 0))
+      assert Enum.all?(loops, &is_binary(&1.explain))
+      assert Enum.any?(loops, &(&1.rows >= 100))
+
+      loops = Enum.filter(XQLite.scan_status(stmt), & &1.name)
+      assert Enum.all?(loops, &(&1.loops == 0 and &1.rows == 0))
+    end
+  end
+
+  describe "db_status/2 and status/1" do
+    test "reports connection counters" do
+      db = XQLite.open(":memory:", [:readwrite])
+      XQLite.exec(db, "create table test(x); insert into test values (1), (2)")
+
+      status = XQLite.db_status(db)
+      assert status.cache_used > 0
+      assert status.schema_used > 0
+      assert status.cache_write > 0
+      assert status.deferred_fks == 0
+
+      stmt = XQLite.prepare(db, "select * from test")
+      assert XQLite.db_status(db).stmt_used > 0
+
+      XQLite.fetch_all(stmt)
+      assert XQLite.db_status(db, reset: true).cache_hit > 0
+      assert XQLite.db_status(db).cache_hit == 0
+    end
+
+    test "raises on a closed connection" do
+      db = XQLite.open(":memory:", [:readonly])
+      XQLite.close(db)
+      assert_raise ArgumentError, fn -> XQLite.db_status(db) end
+    end
+
+    test "reports global counters" do
+      _db = XQLite.open(":memory:", [:readonly])
+      status = XQLite.status()
+      assert {current, highwater} = status.memory_used
+      assert current > 0 and highwater >= current
+      assert {_, _} = status.malloc_count
+      assert {_, _} = status.pagecache_overflow
+    end
+  end
+
+  describe "set_telemetry/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+      {:ok, db: db}
+    end
+
+    test "records calls when enabled", %{db: db} do
+      XQLite.exec(db, "create table test(t text)")
+      assert XQLite.drain_telemetry(db) == {[], 0}
+
+      :ok = XQLite.set_telemetry(db, 16)
+      XQLite.exec(db, "insert into test values ('hello'), ('world!')")
+
+      stmt = XQLite.prepare(db, "select t from test")
+      assert XQLite.fetch_all(stmt) == [["hello"], ["world!"]]
+      assert {:row, ["hello"]} = XQLite.step(stmt)
+
+      insert = XQLite.prepare(db, "insert into test values (?)")
+      assert XQLite.insert_all(insert, [:text], [["a"], ["bc"]], []) == 2
+
+      assert_raise ErlangError, fn -> XQLite.exec(db, "insert into missing values (1)") end
+
+      assert {events, 0} = XQLite.drain_telemetry(db)
+
+      assert [
+               {:exec, start, duration, 0, 0, 0, 0},
+               {:fetch_all, _, _, 2, fetch_vm_steps, 11, 101},
+               {:step, _, _, 1, step_vm_steps, 5, 100},
+               {:insert_all, _, _, 2, insert_vm_steps, 3, 101},
+               {:exec, _, _, 0, 0, 0, 1}
+             ] = events
+
+      assert is_integer(start) and start <= :erlang.monotonic_time(:nanosecond)
+      assert duration >= 0
+      assert fetch_vm_steps > 0 and step_vm_steps > 0 and insert_vm_steps > 0
+
+      assert XQLite.drain_telemetry(db) == {[], 0}
+    end
+
+    test "stops recording when disabled", %{db: db} do
+      :ok = XQLite.set_telemetry(db, 16)
+      :ok = XQLite.set_telemetry(db, false)
+      XQLite.exec(db, "select 1")
+      assert XQLite.drain_telemetry(db) == {[], 0}
+    end
+
+    test "keeps the capacity of the first call", %{db: db} do
+      :ok = XQLite.set_telemetry(db, 16)
+      :ok = XQLite.set_telemetry(db, false)
+      assert_raise ArgumentError, fn -> XQLite.set_telemetry(db, 32) end
+
+      XQLite.exec(db, "select 1")
+      assert XQLite.drain_telemetry(db) == {[], 0}
+
+      :ok = XQLite.set_telemetry(db, 16)
+      XQLite.exec(db, "select 1")
+      assert {[{:exec, _, _, 0, 0, 0, 0}], 0} = XQLite.drain_telemetry(db)
+    end
+
+    test "skips finalized statements", %{db: db} do
+      :ok = XQLite.set_telemetry(db, 16)
+      stmt = XQLite.prepare(db, "select 1")
+      :ok = XQLite.finalize(stmt)
+
+      assert_raise ErlangError, fn -> XQLite.step(stmt) end
+      assert_raise ErlangError, fn -> XQLite.step(stmt, 10) end
+      assert_raise ErlangError, fn -> XQLite.fetch_all(stmt) end
+      assert XQLite.drain_telemetry(db) == {[], 0}
+    end
+
+    test "drops events when full", %{db: db} do
+      :ok = XQLite.set_telemetry(db, 4)
+      for _ <- 1..10, do: XQLite.exec(db, "select 1")
+
+      assert {events, 6} = XQLite.drain_telemetry(db, 2)
+      assert length(events) == 2
+      assert {events, 0} = XQLite.drain_telemetry(db)
+      assert length(events) == 2
+    end
+
+    test "records from concurrent processes", %{db: db} do
+      :ok = XQLite.set_telemetry(db, 1024)
+
+      1..8
+      |> Enum.map(fn _ ->
+        Task.async(fn -> for _ <- 1..50, do: XQLite.exec(db, "select 1") end)
+      end)
+      |> Task.await_many()
+
+      assert {events, 0} = XQLite.drain_telemetry(db)
+      assert length(events) == 400
+    end
+  end
+
+  describe "set_slow_query_log/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readonly])
+
+      slow = """
+      with recursive c(x) as (values(1) union all select x + 1 from c where x < ?)
+      select sum(x) from c
+      """
+
+      {:ok, db: db, slow: XQLite.prepare(db, slow), fast: XQLite.prepare(db, "select ?")}
+    end
+
+    test "captures only statements over the threshold", %{db: db, slow: slow, fast: fast} do
+      :ok = XQLite.set_slow_query_log(db, threshold: 5)
+
+      XQLite.bind_integer(fast, 1, 1)
+      XQLite.fetch_all(fast)
+      XQLite.bind_integer(slow, 1, 1_000_000)
+      XQLite.fetch_all(slow)
+
+      assert {[{sql, ns}], 0} = XQLite.slow_queries(db)
+      assert sql =~ "select x + 1 from c where x < 1000000"
+      assert ns >= 5_000_000
+
+      assert XQLite.slow_queries(db) == {[], 0}
+    end
+
+    test "keeps the newest entries", %{db: db, fast: fast} do
+      :ok = XQLite.set_slow_query_log(db, threshold: 0, capacity: 2)
+
+      for i <- 1..5 do
+        XQLite.bind_integer(fast, 1, i)
+        XQLite.fetch_all(fast)
+      end
+
+      assert {[{"select 4", _}, {"select 5", _}], 3} = XQLite.slow_queries(db)
+    end
+
+    test "sends entries to a pid", %{db: db, fast: fast} do
+      :ok = XQLite.set_slow_query_log(db, threshold: 0, pid: self())
+      XQLite.bind_integer(fast, 1, 42)
+      XQLite.fetch_all(fast)
+
+      assert_receive {:xqlite_slow_query, "select 42", ns} when is_integer(ns)
+      assert XQLite.slow_queries(db) == {[], 0}
+    end
+
+    test "sends pending entries before it's turned off", %{db: db, fast: fast} do
+      :ok = XQLite.set_slow_query_log(db, threshold: 0, capacity: 1000, pid: self())
+
+      for i <- 1..100 do
+        XQLite.bind_integer(fast, 1, i)
+        XQLite.fetch_all(fast)
+      end
+
+      :ok = XQLite.set_slow_query_log(db, false)
+
+      for i <- 1..100 do
+        sql = "select #{i}"
+        assert_receive {:xqlite_slow_query, ^sql, _ns}
+      end
+    end
+
+    test "can be turned off", %{db: db, fast: fast} do
+      :ok = XQLite.set_slow_query_log(db, threshold: 0)
+      :ok = XQLite.set_slow_query_log(db, false)
+      XQLite.fetch_all(fast)
+      assert XQLite.slow_queries(db) == {[], 0}
+    end
+  end
+
+  describe "query_plan/1 and set_plan_tracking/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+      XQLite.exec(db, "create table t(a integer, b integer)")
+      {:ok, db: db}
+    end
+
+    test "returns the plan tree", %{db: db} do
+      XQLite.exec(db, "create table u(a integer)")
+      stmt = XQLite.prepare(db, "select * from t where a in (select a from u) order by b")
+
+      assert [
+               %{detail: "SCAN t", children: []},
+               %{detail: "LIST SUBQUERY " <> _, children: [%{detail: "SCAN u"}]},
+               %{detail: "USE TEMP B-TREE FOR ORDER BY"}
+             ] = XQLite.query_plan(stmt)
+    end
+
+    test "reports plan changes of cached statements", %{db: db} do
+      sql = "select * from t where a = ?"
+      :ok = XQLite.set_plan_tracking(db, self())
+
+      stmt = XQLite.prepare_cached(db, sql)
+      assert XQLite.query_all(stmt, [1]) == []
+
+      XQLite.exec(db, "create table unrelated(x)")
+      stmt = XQLite.prepare_cached(db, sql)
+      assert XQLite.query_all(stmt, [1]) == []
+      assert XQLite.prepare_cached(db, sql) == stmt
+      refute_received {:xqlite_plan_changed, _, _}
+
+      XQLite.exec(db, "create index t_a on t(a)")
+      assert XQLite.query_all(stmt, [1]) == []
+      assert XQLite.prepare_cached(db, sql) == stmt
+
+      assert_received {:xqlite_plan_changed, ^sql, rows}
+      assert [%{detail: "SEARCH t USING INDEX t_a (a=?)"}] = XQLite.plan_tree(rows)
+    end
+
+    test "stops reporting when turned off", %{db: db} do
+      sql = "select * from t where b = ?"
+      :ok = XQLite.set_plan_tracking(db, self())
+      stmt = XQLite.prepare_cached(db, sql)
+
+      :ok = XQLite.set_plan_tracking(db, nil)
+      XQLite.exec(db, "create index t_b on t(b)")
+      assert XQLite.query_all(stmt, [1]) == []
+      assert XQLite.prepare_cached(db, sql) == stmt
+      refute_received {:xqlite_plan_changed, _, _}
+    end
+  end
+
+  describe "bind_map/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readonly])
+      {:ok, db: db}
+    end
+
+    test "binds atom and binary keys", %{db: db} do
+      stmt = XQLite.prepare(db, "select :a, @b, $c, :a")
+      assert XQLite.bind_map(stmt, %{:a => 1, "@b" => "two", "c" => 3.0}) == :ok
+      assert XQLite.step(stmt) == {:row, [1, "two", 3.0, 1]}
+
+      XQLite.reset(stmt)
+      assert XQLite.bind_map(stmt, %{"a" => nil, b: {:blob, <<0>>}, "$c" => false}) == :ok
+      assert XQLite.step(stmt) == {:row, [nil, <<0>>, 0, nil]}
+    end
+
+    test "keeps large binaries bound", %{db: db} do
+      stmt = XQLite.prepare(db, "select length(:text)")
+      XQLite.bind_map(stmt, %{text: String.duplicate("a", 1000)})
+      :erlang.garbage_collect()
+      assert XQLite.step(stmt) == {:row, [1000]}
+    end
+
+    test "resolves atoms created after prepare", %{db: db} do
+      stmt = XQLite.prepare(db, "select :xqlite_bind_map_late_atom")
+      key = String.to_atom("xqlite_bind_map_late_atom")
+      assert XQLite.bind_map(stmt, %{key => 1}) == :ok
+      assert XQLite.step(stmt) == {:row, [1]}
+    end
+
+    test "raises on unknown keys and values", %{db: db} do
+      stmt = XQLite.prepare(db, "select :a, ?2")
+      assert_raise ArgumentError, fn -> XQLite.bind_map(stmt, %{b: 1}) end
+      assert_raise ArgumentError, fn -> XQLite.bind_map(stmt, %{"?2" => 1}) end
+      assert_raise ArgumentError, fn -> XQLite.bind_map(stmt, %{a: :b}) end
+      assert_raise ArgumentError, fn -> XQLite.bind_map(stmt, [a: 1]) end
+    end
+  end
+
+  describe "run_batch/3" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+      XQLite.exec(db, "create table test(i integer primary key, v any) strict")
+      insert = XQLite.prepare(db, "insert into test(i, v) values (?, ?)")
+      select = XQLite.prepare(db, "select v, typeof(v) from test where i = ?")
+      {:ok, db: db, insert: insert, select: select}
+    end
+
+    test "infers param types", %{db: db, insert: insert, select: select} do
+      values = [1, 0x100000000, 1.5, "text", {:blob, <<0, 1>>}, nil, true, false]
+
+      batch =
+        values
+        |> Enum.with_index()
+        |> Enum.flat_map(fn {value, i} -> [{insert, [i, value]}, {select, [i]}] end)
+
+      assert XQLite.run_batch(db, batch) == [
+               [],
+               [[1, "integer"]],
+               [],
+               [[0x100000000, "integer"]],
+               [],
+               [[1.5, "real"]],
+               [],
+               [["text", "text"]],
+               [],
+               [[<<0, 1>>, "blob"]],
+               [],
+               [[nil, "null"]],
+               [],
+               [[1, "integer"]],
+               [],
+               [[0, "integer"]]
+             ]
+    end
+
+    test "rolls back the savepoint on error", %{db: db, insert: insert} do
+      batch = [{insert, [1, "a"]}, {insert, [2, "b"]}, {insert, [1, "c"]}]
+
+      assert_raise ErlangError, ~r/UNIQUE constraint failed/, fn ->
+        XQLite.run_batch(db, batch, savepoint: true)
+      end
+
+      assert prepare_fetch_all(db, "select count(*) from test") == [[0]]
+      assert XQLite.get_autocommit(db) == 1
+
+      assert_raise ErlangError, ~r/UNIQUE constraint failed/, fn ->
+        XQLite.run_batch(db, batch)
+      end
+      assert prepare_fetch_all(db, "select count(*) from test") == [[2]]
+    end
+
+    test "raises on malformed batches", %{db: db, insert: insert} do
+      assert_raise ArgumentError, fn -> XQLite.run_batch(db, [{insert, [1]}]) end
+      assert_raise ArgumentError, fn -> XQLite.run_batch(db, [{insert, [1, %{}]}]) end
+
+      other = XQLite.open(":memory:", [:readonly])
+      stmt = XQLite.prepare(other, "select ?")
+      assert_raise ArgumentError, fn -> XQLite.run_batch(db, [{stmt, [1]}]) end
+    end
+  end
+
+  describe "query_one/2 and query_all/2" do
+    setup do
+      db = XQLite.open(":memory:", [:readwrite])
+      XQLite.exec(db, "create table test(i integer primary key, t text)")
+      XQLite.exec(db, "insert into test values (1, 'a'), (2, 'b'), (3, 'c')")
+      {:ok, db: db}
+    end
+
+    test "bind, step and reset in one call", %{db: db} do
+      stmt = XQLite.prepare(db, "select t from test where i = ?")
+      assert XQLite.query_one(stmt, [2]) == ["b"]
+      assert XQLite.query_one(stmt, [4]) == nil
+      assert XQLite.query_one(stmt, [1]) == ["a"]
+
+      stmt = XQLite.prepare(db, "select i from test where t >= ? order by i")
+      assert XQLite.query_all(stmt, ["b"]) == [[2], [3]]
+      assert XQLite.query_all(stmt, ["d"]) == []
+    end
+
+    test "leaves the statement reset with cleared bindings", %{db: db} do
+      stmt = XQLite.prepare(db, "select ?")
+      assert XQLite.query_one(stmt, ["hello"]) == ["hello"]
+      assert XQLite.step(stmt) == {:row, [nil]}
+    end
+
+    test "raises on bad params and errors", %{db: db} do
+      stmt = XQLite.prepare(db, "select t from test where i = ?")
+      assert_raise ArgumentError, fn -> XQLite.query_one(stmt, []) end
+      assert_raise ArgumentError, fn -> XQLite.query_all(stmt, [:one]) end
+
+      stmt = XQLite.prepare(db, "insert into test(i, t) values (?, ?)")
+
+      assert_raise ErlangError, ~r/UNIQUE constraint failed/, fn ->
+        XQLite.query_all(stmt, [1, "x"])
+      end
+
+      assert XQLite.query_all(stmt, [4, "d"]) == []
+    end
+  end
+
   defp prepare_fetch_all(db, sql) do
     XQLite.fetch_all(XQLite.prepare(db, sql))
   end